@@ -0,0 +1,28 @@
+// Remove duplicate reads of each block by bseq_pool_dedup(), the read of best quality is kept.
+#include "stream_plugin.h"
+
+#define DEDUP_MIN_LENGTH 16 // seed length of bseq_pool_dedup()
+
+int init(const char *arg)
+{
+    return 0;
+}
+int process_block(struct bseq_pool *in, struct bseq_pool *out)
+{
+    int i;
+    for (i = 0; i < in->n; ++i) {
+        struct bseq *b = &in->s[i];
+        if (b->s0.l < DEDUP_MIN_LENGTH || (b->s1.l > 0 && b->s1.l < DEDUP_MIN_LENGTH)) break;
+    }
+    // reads shorter than the seed cannot be compared, keep all of them, read 2 is also seeded if paired
+    if (i == in->n) bseq_pool_dedup(in);
+
+    for (i = 0; i < in->n; ++i) {
+        if (in->s[i].flag == FQ_DUP) continue;
+        bseq_pool_push(&in->s[i], out);
+    }
+    return 0;
+}
+void finish()
+{
+}
@@ -0,0 +1,90 @@
+// Count k-mers of each block. K-mers seen at least twice are written as FASTA records, sorted by
+// count, with the count in tag KC. K is set by -plugin-arg, 21 by default.
+#include "stream_plugin.h"
+#include "htslib/khash.h"
+
+KHASH_MAP_INIT_INT64(kmer, int)
+
+static int kmer_size = 21;
+static uint64_t n_block = 0;
+static uint64_t n_kmer = 0;
+
+struct kmer_count {
+    uint64_t kmer;
+    int count;
+};
+
+static int kmer_count_cmp(const void *a, const void *b)
+{
+    const struct kmer_count *ka = a, *kb = b;
+    if (ka->count != kb->count) return kb->count - ka->count;
+    return ka->kmer < kb->kmer ? -1 : ka->kmer > kb->kmer;
+}
+static void kmer_add(khash_t(kmer) *h, const char *s, int l)
+{
+    static const int8_t nt4[256] = {
+        ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4,
+        ['a'] = 1, ['c'] = 2, ['g'] = 3, ['t'] = 4,
+    };
+    uint64_t mask = (1ULL << (kmer_size*2)) - 1;
+    uint64_t x = 0;
+    int i, len = 0;
+    for (i = 0; i < l; ++i) {
+        int c = nt4[(uint8_t)s[i]];
+        if (c == 0) { // k-mers with N are skipped
+            len = 0;
+            continue;
+        }
+        x = (x << 2 | (c - 1)) & mask;
+        if (++len < kmer_size) continue;
+        int ret;
+        khint_t k = kh_put(kmer, h, x, &ret);
+        if (ret) kh_val(h, k) = 0;
+        kh_val(h, k)++;
+    }
+}
+int init(const char *arg)
+{
+    if (arg) kmer_size = atoi(arg);
+    if (kmer_size < 1 || kmer_size > 31) {
+        fprintf(stderr, "K-mer size should be 1 to 31.\n");
+        return 1;
+    }
+    return 0;
+}
+int process_block(struct bseq_pool *in, struct bseq_pool *out)
+{
+    khash_t(kmer) *h = kh_init(kmer);
+    int i;
+    for (i = 0; i < in->n; ++i) {
+        kmer_add(h, in->s[i].s0.s, in->s[i].s0.l);
+        kmer_add(h, in->s[i].s1.s, in->s[i].s1.l);
+    }
+
+    struct kmer_count *a = malloc(kh_size(h)*sizeof(*a) + 1);
+    int n = 0;
+    khint_t k;
+    for (k = kh_begin(h); k != kh_end(h); ++k) {
+        if (!kh_exist(h, k) || kh_val(h, k) < 2) continue;
+        a[n].kmer = kh_key(h, k);
+        a[n].count = kh_val(h, k);
+        n++;
+    }
+    qsort(a, n, sizeof(*a), kmer_count_cmp);
+    for (i = 0; i < n; ++i) {
+        struct bseq *b = bseq_pool_next(out);
+        ksprintf(&b->n0, "kmer%d|||KC:i:%d", i+1, a[i].count);
+        int j;
+        for (j = kmer_size - 1; j >= 0; --j) kputc("ACGT"[a[i].kmer >> (j*2) & 3], &b->s0);
+        out->n++;
+    }
+    __sync_fetch_and_add(&n_block, 1);
+    __sync_fetch_and_add(&n_kmer, n);
+    free(a);
+    kh_destroy(kmer, h);
+    return 0;
+}
+void finish()
+{
+    LOG_print("Count %d-mers of %" PRIu64 " blocks, %" PRIu64 " k-mers written.", kmer_size, n_block, n_kmer);
+}
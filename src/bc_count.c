@@ -0,0 +1,327 @@
+#include "utils.h"
+#include "bc_count.h"
+#include "htslib/khash.h"
+#include <math.h>
+
+// exact mode : packed barcode -> count; sketch mode : packed barcode -> position in heap
+KHASH_MAP_INIT_INT64(bcc, uint32_t)
+
+#define BC_CM_DEPTH 4
+#define BC_CM_MIN_WIDTH (1<<16)
+#define BC_CM_MAX_WIDTH (1<<20)
+
+struct bc_count {
+    int top;
+    uint64_t total;
+    uint64_t skipped;
+    kh_bcc_t *h;
+    // sketch mode
+    int merged; // candidates of merged sketch are not in heap order
+    uint32_t w; // width of each row, power of 2
+    uint32_t *cm;
+    int n; // candidates in heap
+    uint64_t *hk; // min heap of candidates, ordered by estimated count
+    uint32_t *hc;
+};
+
+// A C G T to 0-3, others 4
+static const uint8_t bcc_nt4_table[256] = {
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 0, 4, 1,  4, 4, 4, 2,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  3, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4
+};
+
+// leading 1 bit keeps barcodes of different length apart
+static inline int bcc_pack(const char *s, int l, uint64_t *key)
+{
+    if (l == 0 || l > BC_COUNT_MAX_LENGTH) return 1;
+    uint64_t k = 1;
+    int i;
+    for (i = 0; i < l; ++i) {
+        uint8_t c = bcc_nt4_table[(uint8_t)s[i]];
+        if (c > 3) return 1;
+        k = k<<2 | c;
+    }
+    *key = k;
+    return 0;
+}
+static int bcc_unpack(uint64_t key, char *s)
+{
+    static const char nt[4] = { 'A', 'C', 'G', 'T' };
+    int l = (63 - __builtin_clzll(key)) >> 1;
+    int i;
+    for (i = l - 1; i >= 0; --i) {
+        s[i] = nt[key & 3];
+        key >>= 2;
+    }
+    s[l] = '\0';
+    return l;
+}
+static inline uint64_t bcc_hash(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+// row indices by double hashing
+static inline void cm_index(const struct bc_count *c, uint64_t key, uint32_t *idx)
+{
+    uint64_t h = bcc_hash(key);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    int i;
+    for (i = 0; i < BC_CM_DEPTH; ++i)
+        idx[i] = i*c->w + ((h1 + i*h2) & (c->w - 1));
+}
+static uint32_t cm_query(const struct bc_count *c, uint64_t key)
+{
+    uint32_t idx[BC_CM_DEPTH];
+    cm_index(c, key, idx);
+    uint32_t m = c->cm[idx[0]];
+    int i;
+    for (i = 1; i < BC_CM_DEPTH; ++i)
+        if (c->cm[idx[i]] < m) m = c->cm[idx[i]];
+    return m;
+}
+// conservative update, only the smallest cells are increased
+static uint32_t cm_add(struct bc_count *c, uint64_t key)
+{
+    uint32_t idx[BC_CM_DEPTH];
+    cm_index(c, key, idx);
+    uint32_t m = c->cm[idx[0]];
+    int i;
+    for (i = 1; i < BC_CM_DEPTH; ++i)
+        if (c->cm[idx[i]] < m) m = c->cm[idx[i]];
+    if (m == UINT32_MAX) return m;
+    m++;
+    for (i = 0; i < BC_CM_DEPTH; ++i)
+        if (c->cm[idx[i]] < m) c->cm[idx[i]] = m;
+    return m;
+}
+
+struct bc_count *bc_count_init(int top)
+{
+    struct bc_count *c = malloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->top = top;
+    c->h = kh_init(bcc);
+    if (top > 0) {
+        uint32_t w = BC_CM_MIN_WIDTH;
+        while (w < BC_CM_MAX_WIDTH && w < (uint64_t)top*64) w <<= 1;
+        c->w = w;
+        c->cm = calloc((size_t)w*BC_CM_DEPTH, sizeof(uint32_t));
+        c->hk = malloc(top*sizeof(uint64_t));
+        c->hc = malloc(top*sizeof(uint32_t));
+    }
+    return c;
+}
+void bc_count_destroy(struct bc_count *c)
+{
+    kh_destroy(bcc, c->h);
+    if (c->cm) free(c->cm);
+    if (c->hk) free(c->hk);
+    if (c->hc) free(c->hc);
+    free(c);
+}
+
+static inline void heap_set(struct bc_count *c, int i, uint64_t key, uint32_t cnt)
+{
+    c->hk[i] = key;
+    c->hc[i] = cnt;
+    khint_t k = kh_get(bcc, c->h, key);
+    kh_val(c->h, k) = i;
+}
+static void heap_down(struct bc_count *c, int i)
+{
+    uint64_t key = c->hk[i];
+    uint32_t cnt = c->hc[i];
+    for (;;) {
+        int j = i*2 + 1;
+        if (j >= c->n) break;
+        if (j+1 < c->n && c->hc[j+1] < c->hc[j]) j++;
+        if (cnt <= c->hc[j]) break;
+        heap_set(c, i, c->hk[j], c->hc[j]);
+        i = j;
+    }
+    heap_set(c, i, key, cnt);
+}
+static void heap_up(struct bc_count *c, int i)
+{
+    uint64_t key = c->hk[i];
+    uint32_t cnt = c->hc[i];
+    while (i > 0) {
+        int j = (i-1) >> 1;
+        if (c->hc[j] <= cnt) break;
+        heap_set(c, i, c->hk[j], c->hc[j]);
+        i = j;
+    }
+    heap_set(c, i, key, cnt);
+}
+static void sketch_add(struct bc_count *c, uint64_t key)
+{
+    uint32_t est = cm_add(c, key);
+    int ret;
+    khint_t k = kh_get(bcc, c->h, key);
+    if (k != kh_end(c->h)) {
+        int i = kh_val(c->h, k);
+        c->hc[i] = est;
+        heap_down(c, i);
+        return;
+    }
+    if (c->n < c->top) {
+        k = kh_put(bcc, c->h, key, &ret);
+        c->hk[c->n] = key;
+        c->hc[c->n] = est;
+        kh_val(c->h, k) = c->n;
+        heap_up(c, c->n++);
+        return;
+    }
+    if (est <= c->hc[0]) return;
+    // replace the smallest candidate
+    k = kh_get(bcc, c->h, c->hk[0]);
+    kh_del(bcc, c->h, k);
+    k = kh_put(bcc, c->h, key, &ret);
+    c->hk[0] = key;
+    c->hc[0] = est;
+    kh_val(c->h, k) = 0;
+    heap_down(c, 0);
+}
+int bc_count_add(struct bc_count *c, const char *s, int l)
+{
+    uint64_t key;
+    if (bcc_pack(s, l, &key)) {
+        c->skipped++;
+        return 1;
+    }
+    c->total++;
+    if (c->top > 0) {
+        if (c->merged) error("Try to count barcodes in a merged sketch.");
+        sketch_add(c, key);
+        return 0;
+    }
+    int ret;
+    khint_t k = kh_put(bcc, c->h, key, &ret);
+    if (ret) kh_val(c->h, k) = 1;
+    else if (kh_val(c->h, k) < UINT32_MAX) kh_val(c->h, k)++;
+    return 0;
+}
+void bc_count_merge(struct bc_count *dst, const struct bc_count *src)
+{
+    if (dst->top != src->top) error("Inconsistent barcode counters.");
+    dst->total += src->total;
+    dst->skipped += src->skipped;
+    int ret;
+    khint_t k, k0;
+    if (dst->top == 0) {
+        for (k = kh_begin(src->h); k != kh_end(src->h); ++k) {
+            if (!kh_exist(src->h, k)) continue;
+            k0 = kh_put(bcc, dst->h, kh_key(src->h, k), &ret);
+            uint64_t v = kh_val(src->h, k);
+            if (!ret) v += kh_val(dst->h, k0);
+            kh_val(dst->h, k0) = v > UINT32_MAX ? UINT32_MAX : v;
+        }
+        return;
+    }
+    // sketches are added, candidates are the union and estimated again at the end
+    size_t i;
+    for (i = 0; i < (size_t)dst->w*BC_CM_DEPTH; ++i) {
+        uint64_t v = (uint64_t)dst->cm[i] + src->cm[i];
+        dst->cm[i] = v > UINT32_MAX ? UINT32_MAX : v;
+    }
+    for (k = kh_begin(src->h); k != kh_end(src->h); ++k) {
+        if (!kh_exist(src->h, k)) continue;
+        kh_put(bcc, dst->h, kh_key(src->h, k), &ret);
+    }
+    dst->merged = 1;
+}
+
+struct bcc_pair {
+    uint64_t key;
+    uint64_t count;
+};
+static int cmp_pair(const void *a, const void *b)
+{
+    const struct bcc_pair *x = (const struct bcc_pair*)a;
+    const struct bcc_pair *y = (const struct bcc_pair*)b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+// Knee of barcode rank curve on log-log scale. The steepest slope between rank r and 2r locates
+// the cliff between cells and background, the largest drop between adjacent ranks in this window
+// is the knee. Return number of barcodes up to knee, or -1 if no clear knee.
+#define BC_KNEE_SLOPE -1.0 // background usually falls no faster than power law of -1
+
+static int bc_knee(const struct bcc_pair *v, int n)
+{
+    if (n < 3) return -1;
+    double best = BC_KNEE_SLOPE;
+    int r, st = -1, ed = -1;
+    for (r = 1; r*2 <= n && v[r-1].count >= BC_COUNT_KNEE_MIN; ++r) {
+        int r2 = r*2;
+        double slope = log10((double)v[r2-1].count/v[r-1].count) / log10((double)r2/r);
+        if (slope < best) {
+            best = slope;
+            st = r;
+            ed = r2;
+        }
+    }
+    if (st < 0) return -1;
+    
+    double drop = 0;
+    int knee = -1;
+    for (r = st; r < ed; ++r) {
+        double d = log10((double)v[r-1].count/v[r].count);
+        if (d > drop) {
+            drop = d;
+            knee = r;
+        }
+    }
+    return knee;
+}
+int bc_count_write(struct bc_count *c, FILE *fp, uint64_t *knee_count)
+{
+    int n = kh_size(c->h), i = 0;
+    struct bcc_pair *v = malloc((n > 0 ? n : 1)*sizeof(struct bcc_pair));
+    khint_t k;
+    for (k = kh_begin(c->h); k != kh_end(c->h); ++k) {
+        if (!kh_exist(c->h, k)) continue;
+        v[i].key = kh_key(c->h, k);
+        v[i].count = c->top > 0 ? cm_query(c, v[i].key) : kh_val(c->h, k);
+        i++;
+    }
+    qsort(v, n, sizeof(struct bcc_pair), cmp_pair);
+    if (c->top > 0 && n > c->top) n = c->top;
+
+    char s[BC_COUNT_MAX_LENGTH+1];
+    for (i = 0; i < n; ++i) {
+        bcc_unpack(v[i].key, s);
+        fprintf(fp, "%s\t%"PRIu64"\n", s, v[i].count);
+    }
+    int knee = bc_knee(v, n);
+    *knee_count = knee > 0 ? v[knee-1].count : 0;
+    free(v);
+    return knee;
+}
+uint64_t bc_count_total(const struct bc_count *c)
+{
+    return c->total;
+}
+uint64_t bc_count_skipped(const struct bc_count *c)
+{
+    return c->skipped;
+}
@@ -0,0 +1,35 @@
+// Barcode abundance counter. Exact mode counts every barcode in a hash table. Sketch mode keeps
+// only the top N barcodes in bounded memory, counts are estimated by a count-min sketch.
+// Barcodes are 2-bit packed, only ACGT barcodes no longer than BC_COUNT_MAX_LENGTH are counted.
+#ifndef BC_COUNT_H
+#define BC_COUNT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define BC_COUNT_MAX_LENGTH 31
+
+// barcodes below this count are not used to estimate the knee
+#define BC_COUNT_KNEE_MIN 10
+
+struct bc_count;
+
+// top == 0 for exact counting, otherwise keep top barcodes in a sketch
+struct bc_count *bc_count_init(int top);
+void bc_count_destroy(struct bc_count *c);
+
+// return 1 if barcode cannot be packed and is skipped
+int bc_count_add(struct bc_count *c, const char *s, int l);
+
+// add counts of src to dst, both should be inited with the same top
+void bc_count_merge(struct bc_count *dst, const struct bc_count *src);
+
+// write "barcode\tcount" sorted by count, return rank of knee or -1 if not estimated.
+// Count of barcode at knee is set to *knee_count.
+int bc_count_write(struct bc_count *c, FILE *fp, uint64_t *knee_count);
+
+// number of barcodes counted and skipped
+uint64_t bc_count_total(const struct bc_count *c);
+uint64_t bc_count_skipped(const struct bc_count *c);
+
+#endif
@@ -0,0 +1,262 @@
+#include "utils.h"
+#include "bc_hash.h"
+#include "htslib/kstring.h"
+#include "htslib/kseq.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+KSTREAM_INIT(gzFile, gzread, 8193)
+
+// A C G T to 0-3, others 4
+static const uint8_t bc_nt4_table[256] = {
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 0, 4, 1,  4, 4, 4, 2,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  3, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4
+};
+
+static inline uint32_t bc_hash_fn(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    return (uint32_t)k;
+}
+
+// return index of key, or -1
+static inline int bc_hash_get(const struct bc_hash *H, uint64_t key)
+{
+    if (H->n_slot == 0) return -1;
+    uint32_t mask = H->n_slot - 1;
+    uint32_t i = bc_hash_fn(key) & mask;
+    for (;;) {
+        uint32_t v = H->slot[i];
+        if (v == 0) return -1;
+        if (H->keys[v-1] == key) return v-1;
+        i = (i+1) & mask;
+    }
+}
+static void bc_hash_put(struct bc_hash *H, uint32_t idx)
+{
+    uint32_t mask = H->n_slot - 1;
+    uint32_t i = bc_hash_fn(H->keys[idx]) & mask;
+    while (H->slot[i]) i = (i+1) & mask;
+    H->slot[i] = idx + 1;
+}
+static void bc_hash_resize(struct bc_hash *H)
+{
+    free(H->slot);
+    H->n_slot = H->n_slot ? H->n_slot << 1 : 1024;
+    H->slot = calloc(H->n_slot, sizeof(uint32_t));
+    uint32_t i;
+    for (i = 0; i < H->n; ++i) bc_hash_put(H, i);
+}
+struct bc_hash *bc_hash_init()
+{
+    struct bc_hash *H = malloc(sizeof(*H));
+    memset(H, 0, sizeof(*H));
+    return H;
+}
+void bc_hash_destroy(struct bc_hash *H)
+{
+    if (H->map) munmap(H->map, H->map_size);
+    else {
+        free(H->keys);
+        free(H->slot);
+    }
+    free(H);
+}
+// pack sequence into key, return number of non-ACGT bases, pos is set to the last one
+static inline int bc_pack(const char *s, int l, uint64_t *key, int *pos)
+{
+    uint64_t k = 0;
+    int i, n = 0;
+    for (i = 0; i < l; ++i) {
+        uint8_t c = bc_nt4_table[(uint8_t)s[i]];
+        if (c > 3) { n++; *pos = i; c = 0; }
+        k = k<<2 | c;
+    }
+    *key = k;
+    return n;
+}
+int bc_hash_push(struct bc_hash *H, const char *s, int l)
+{
+    if (H->map) error("Barcode index is read only.");
+    if (l == 0 || l > BC_HASH_MAX_LENGTH) return -1;
+    if (H->len == 0) H->len = l;
+    if (l != H->len) return -1;
+    uint64_t key;
+    int pos;
+    if (bc_pack(s, l, &key, &pos)) return -1;
+    int idx = bc_hash_get(H, key);
+    if (idx >= 0) return idx; // duplicated
+
+    if (H->n == H->m) {
+        H->m = H->m ? H->m << 1 : 1024;
+        H->keys = realloc(H->keys, H->m*sizeof(uint64_t));
+    }
+    H->keys[H->n] = key;
+    H->n++;
+    // keep load factor below 0.5
+    if (H->n*2 > H->n_slot) bc_hash_resize(H);
+    else bc_hash_put(H, H->n-1);
+    return H->n-1;
+}
+int bc_hash_read(struct bc_hash *H, const char *fn)
+{
+    gzFile fp;
+    fp = gzopen(fn, "r");
+    if (fp == NULL) error("%s : %s.", fn, strerror(errno));
+    kstream_t *ks = ks_init(fp);
+    kstring_t str = {0,0,0};
+    int ret, failed = 0;
+    while (ks_getuntil(ks, 2, &str, &ret)>=0){
+        if (str.l == 0) continue;
+        if (str.s[0] == '#') continue;
+        if (strcmp(str.s, "Barcode") == 0) {
+            warnings("\"Barcode\" in %s looks like a title, skip it. ", fn);
+            continue; // emit header
+        }
+        int l = 0;
+        while (l < str.l && !isspace(str.s[l])) l++;
+        if (bc_hash_push(H, str.s, l) < 0) {
+            failed = 1;
+            break;
+        }
+    }
+    if (str.m) free(str.s);
+    ks_destroy(ks);
+    gzclose(fp);
+    return failed || H->n == 0;
+}
+// try all bases at pos, return index if only one hit, -1 on none, -2 on multi hits
+static inline int bc_hash_sub(const struct bc_hash *H, uint64_t key, int pos, int skip)
+{
+    int shift = (H->len - 1 - pos) << 1;
+    uint64_t k0 = key & ~(3ULL << shift);
+    int c, hit = -1;
+    for (c = 0; c < 4; ++c) {
+        if (c == skip) continue;
+        int idx = bc_hash_get(H, k0 | (uint64_t)c << shift);
+        if (idx < 0) continue;
+        if (hit >= 0) return -2;
+        hit = idx;
+    }
+    return hit;
+}
+int bc_hash_query(const struct bc_hash *H, const char *s, int l, int mis, int *exact)
+{
+    *exact = 0;
+    if (l != H->len) return -1;
+    uint64_t key;
+    int pos = -1;
+    int n = bc_pack(s, l, &key, &pos);
+    if (n == 0) {
+        int idx = bc_hash_get(H, key);
+        if (idx >= 0) {
+            *exact = 1;
+            return idx;
+        }
+    }
+    if (mis == 0 || n > 1) return -1;
+
+    // N base can only be replaced at its own position
+    if (n == 1) {
+        int idx = bc_hash_sub(H, key, pos, -1);
+        return idx >= 0 ? idx : -1;
+    }
+
+    // first position with unique substitution wins, ambiguous positions are skipped
+    int j;
+    for (j = 0; j < l; ++j) {
+        int shift = (l - 1 - j) << 1;
+        int idx = bc_hash_sub(H, key, j, (key >> shift) & 3);
+        if (idx >= 0) return idx;
+    }
+    return -1;
+}
+/*
+  Index file layout, native byte order:
+    char     magic[8]  "PISAWL1\0"
+    uint32_t len, n, n_slot, reserved
+    uint64_t keys[n]
+    uint32_t slot[n_slot]
+ */
+#define BC_HASH_MAGIC "PISAWL1"
+#define BC_HASH_HEADER 24
+
+int bc_hash_dump(const struct bc_hash *H, const char *fn)
+{
+    FILE *fp = fopen(fn, "wb");
+    if (fp == NULL) {
+        warnings("%s : %s.", fn, strerror(errno));
+        return 1;
+    }
+    uint32_t hdr[4] = { H->len, H->n, H->n_slot, 0 };
+    int ret = 0;
+    if (fwrite(BC_HASH_MAGIC, 1, 8, fp) != 8) ret = 1;
+    if (!ret && fwrite(hdr, sizeof(uint32_t), 4, fp) != 4) ret = 1;
+    if (!ret && fwrite(H->keys, sizeof(uint64_t), H->n, fp) != H->n) ret = 1;
+    if (!ret && fwrite(H->slot, sizeof(uint32_t), H->n_slot, fp) != H->n_slot) ret = 1;
+    if (fclose(fp)) ret = 1;
+    if (ret) warnings("Failed to write %s.", fn);
+    return ret;
+}
+struct bc_hash *bc_hash_load(const char *fn)
+{
+    int fd = open(fn, O_RDONLY);
+    if (fd == -1) error("%s : %s.", fn, strerror(errno));
+    char magic[8];
+    if (read(fd, magic, 8) != 8 || memcmp(magic, BC_HASH_MAGIC, 8) != 0) {
+        close(fd);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) error("%s : %s.", fn, strerror(errno));
+    
+    uint32_t hdr[4];
+    if (read(fd, hdr, sizeof(hdr)) != sizeof(hdr)) error("Truncated barcode index %s.", fn);
+    if (hdr[0] == 0 || hdr[0] > BC_HASH_MAX_LENGTH || hdr[2] == 0 || (hdr[2] & (hdr[2]-1))
+        || st.st_size != BC_HASH_HEADER + (off_t)hdr[1]*sizeof(uint64_t) + (off_t)hdr[2]*sizeof(uint32_t))
+        error("Corrupted barcode index %s.", fn);
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) error("Failed to mmap %s : %s.", fn, strerror(errno));
+    
+    struct bc_hash *H = bc_hash_init();
+    H->len = hdr[0];
+    H->n = hdr[1];
+    H->n_slot = hdr[2];
+    H->map = map;
+    H->map_size = st.st_size;
+    H->keys = (uint64_t*)((char*)map + BC_HASH_HEADER);
+    H->slot = (uint32_t*)(H->keys + H->n);
+    return H;
+}
+int bc_hash_decode(const struct bc_hash *H, int idx, char *out)
+{
+    static const char nt[4] = { 'A', 'C', 'G', 'T' };
+    uint64_t key = H->keys[idx];
+    int i;
+    for (i = H->len - 1; i >= 0; --i) {
+        out[i] = nt[key & 3];
+        key >>= 2;
+    }
+    return H->len;
+}
@@ -0,0 +1,41 @@
+// Barcode whitelist packed in 2-bit integer keys, with open addressing hash index.
+// Mismatch barcodes are corrected by substituting bases of the packed key, no variants are stored.
+#ifndef BC_HASH_H
+#define BC_HASH_H
+
+#include <stdint.h>
+
+#define BC_HASH_MAX_LENGTH 32
+
+struct bc_hash {
+    int len;        // length of barcodes, all barcodes should be the same length
+    uint32_t n, m;  // number of barcodes
+    uint64_t *keys; // packed barcodes, ordered by input
+    uint32_t n_slot; // power of 2
+    uint32_t *slot; // index+1 of keys, 0 for empty slot
+    void *map; // keys and slot point into this read-only mapping if loaded from index file
+    size_t map_size;
+};
+
+struct bc_hash *bc_hash_init();
+void bc_hash_destroy(struct bc_hash *H);
+
+// return index of barcode, -1 if not a fixed length ACGT string
+int bc_hash_push(struct bc_hash *H, const char *s, int l);
+
+// read whitelist from file, return 1 if any barcode cannot be packed
+int bc_hash_read(struct bc_hash *H, const char *fn);
+
+// return index of barcode, -1 on not found. If mis > 0, correct one mismatch if the hit is unique.
+int bc_hash_query(const struct bc_hash *H, const char *s, int l, int mis, int *exact);
+
+// write barcodes and hash slots to a binary index file, return 1 on failure
+int bc_hash_dump(const struct bc_hash *H, const char *fn);
+
+// mmap a binary index file, return NULL if file is not an index
+struct bc_hash *bc_hash_load(const char *fn);
+
+// write barcode of idx to out, return length
+int bc_hash_decode(const struct bc_hash *H, int idx, char *out);
+
+#endif
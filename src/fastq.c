@@ -1,10 +1,12 @@
+#define _GNU_SOURCE
 #include "fastq.h"
 #include "number.h"
-#include "htslib/kseq.h"
 #include "htslib/kstring.h"
+#include "htslib/hts.h"
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 #include <zlib.h>
-
-KSEQ_INIT(gzFile, gzread)
+#include <pthread.h>
 
 int check_name(char *s1, char *s2)
 {
@@ -66,7 +68,8 @@ void bseq_destroy(struct bseq *b)
 void bseq_pool_clean(struct bseq_pool *p)
 {
     int i;
-    for ( i = 0; i < p->n; ++i ) {
+    int n = p->n > p->n_alloc ? p->n : p->n_alloc;
+    for ( i = 0; i < n; ++i ) {
         struct bseq *b = &p->s[i];
         bseq_clean(b);
     }
@@ -78,6 +81,81 @@ void bseq_pool_destroy(struct bseq_pool *p)
     free(p);
 }
 
+// empty record but keep buffers
+static void bseq_reset(struct bseq *b)
+{
+    b->flag = 0;
+    b->n0.l = 0;
+    b->s0.l = b->q0.l = 0;
+    b->s1.l = b->q1.l = 0;
+    b->s2.l = b->q2.l = 0;
+    b->s3.l = b->q3.l = 0;
+    b->data = NULL;
+}
+struct bseq *bseq_pool_next(struct bseq_pool *p)
+{
+    if (p->n == p->m) {
+        p->m = p->m == 0 ? 16 : p->m<<1;
+        p->s = realloc(p->s, sizeof(struct bseq)*p->m);
+    }
+    struct bseq *b = &p->s[p->n];
+    if (p->n < p->n_alloc) bseq_reset(b);
+    else {
+        bseq_unset(b);
+        p->n_alloc = p->n + 1;
+    }
+    return b;
+}
+
+// free list of pools, bounded so a burst of chunks does not pin memory forever
+#define BSEQ_POOL_FREE_MAX 256
+
+static struct {
+    pthread_mutex_t lock;
+    int n;
+    struct bseq_pool *p[BSEQ_POOL_FREE_MAX];
+} bseq_free = { PTHREAD_MUTEX_INITIALIZER, 0, {0} };
+
+struct bseq_pool *bseq_pool_get(int size)
+{
+    struct bseq_pool *p = NULL;
+    pthread_mutex_lock(&bseq_free.lock);
+    if (bseq_free.n > 0) p = bseq_free.p[--bseq_free.n];
+    pthread_mutex_unlock(&bseq_free.lock);
+
+    if (p == NULL) return bseq_pool_init(size);
+    
+    if (p->m < size) {
+        p->m = size;
+        p->s = realloc(p->s, sizeof(struct bseq)*p->m);
+    }
+    return p;
+}
+void bseq_pool_recycle(struct bseq_pool *p)
+{
+    if (p->n > p->n_alloc) p->n_alloc = p->n;
+    p->n = 0;
+    p->force_fasta = 0;
+    p->opts = NULL;
+
+    pthread_mutex_lock(&bseq_free.lock);
+    if (bseq_free.n < BSEQ_POOL_FREE_MAX) {
+        bseq_free.p[bseq_free.n++] = p;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&bseq_free.lock);
+
+    if (p) bseq_pool_destroy(p);
+}
+void bseq_pool_free_list_destroy()
+{
+    pthread_mutex_lock(&bseq_free.lock);
+    int i;
+    for (i = 0; i < bseq_free.n; ++i) bseq_pool_destroy(bseq_free.p[i]);
+    bseq_free.n = 0;
+    pthread_mutex_unlock(&bseq_free.lock);
+}
+
 void trim_read_tail(char *s, int l)
 {
     if ( l > 2 && s[l-2] == '/' ) s[l-2] = '\0';    
@@ -103,69 +181,427 @@ int kstr_copy(kstring_t *a, kstring_t *b)
     return 0;
 }
 
+// Decompression stage. Every input file (or comma separated list of files) gets its
+// own inflate thread, which fills a bounded ring of decoded buffers. Buffers always
+// end at a line boundary, so the reader only slices lines out of decoded memory.
+// BGZF blocks are inflated in parallel by the shared htslib thread pool.
+#define FQ_STREAM_BUF_SIZE  0x100000 // 1M decoded bytes per buffer
+#define FQ_STREAM_N_BUF     8        // buffers per input file
+
+struct fq_buf {
+    int l, m;
+    char *s;
+};
+
+// a range of decoded bytes starting at BGZF virtual offset
+struct fq_seg {
+    uint64_t voff;
+    uint64_t bytes;
+};
+
+struct fq_stream {
+    int n_file;
+    char **fn;
+    BGZF *fp;
+    hts_tpool *pool; // shared by all files, not owned
+    int n_seg; // if set, only read these ranges of the single input file
+    struct fq_seg *seg;
+
+    pthread_t tid;
+    int started;
+    int stop;  // set by reader to stop inflate thread
+    int eof;   // set by inflate thread at end of last file
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    struct fq_buf *bufs;
+    // decoded buffers ready to read, and free buffers, both FIFO rings of buffer index
+    int *full, i_full, n_full;
+    int *free, i_free, n_free;
+
+    // reader side
+    int cur;   // buffer in reading, -1 for none
+    int pos;   // read offset of current buffer
+    int n_held, *held;  // buffers still referred to by current record
+    char *peek;
+    int l_peek;
+
+    // current record, name and single line seq and qual point to decoded buffer directly
+    kstring_t name, seq, qual;
+    kstring_t name0, seq0, qual0; // own memory for multi-line or very long records
+};
+
+static BGZF *fq_stream_open_file(const char *fn)
+{
+    BGZF *fp = strcmp(fn, "-") == 0 ? bgzf_dopen(fileno(stdin), "r") : bgzf_open(fn, "r");
+    if (fp == NULL) error("Failed to open %s : %s.", fn, strerror(errno));
+    return fp;
+}
+
+static struct fq_stream *fq_stream_init(char **fn, int n_file)
+{
+    struct fq_stream *s = malloc(sizeof(*s));
+    memset(s, 0, sizeof(*s));
+    s->n_file = n_file;
+    s->fn = fn;
+    s->fp = fq_stream_open_file(fn[0]);
+    s->cur = -1;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->not_empty, NULL);
+    pthread_cond_init(&s->not_full, NULL);
+
+    s->bufs = malloc(FQ_STREAM_N_BUF*sizeof(struct fq_buf));
+    s->full = malloc(FQ_STREAM_N_BUF*sizeof(int));
+    s->free = malloc(FQ_STREAM_N_BUF*sizeof(int));
+    s->held = malloc(FQ_STREAM_N_BUF*sizeof(int));
+    int i;
+    for (i = 0; i < FQ_STREAM_N_BUF; ++i) {
+        struct fq_buf *b = &s->bufs[i];
+        b->l = 0;
+        b->m = FQ_STREAM_BUF_SIZE;
+        b->s = malloc(b->m);
+        s->free[i] = i;
+    }
+    s->n_free = FQ_STREAM_N_BUF;
+    return s;
+}
+
+// inflate thread side, return -1 if reader asked to stop
+static int fq_stream_get_free(struct fq_stream *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->n_free == 0 && s->stop == 0)
+        pthread_cond_wait(&s->not_full, &s->lock);
+    int idx = -1;
+    if (s->stop == 0) {
+        idx = s->free[s->i_free];
+        s->i_free = (s->i_free + 1) % FQ_STREAM_N_BUF;
+        s->n_free--;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return idx;
+}
+
+static void fq_stream_put_full(struct fq_stream *s, int idx)
+{
+    pthread_mutex_lock(&s->lock);
+    s->full[(s->i_full + s->n_full) % FQ_STREAM_N_BUF] = idx;
+    s->n_full++;
+    pthread_cond_signal(&s->not_empty);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void *fq_stream_inflate(void *_s)
+{
+    struct fq_stream *s = (struct fq_stream*)_s;
+    int curr = 0;
+    int idx = fq_stream_get_free(s);
+    if (idx < 0) return NULL;
+
+    int i_seg = 0;
+    int64_t left = -1; // bytes left in current range, -1 for whole file
+    if (s->n_seg) {
+        if (bgzf_seek(s->fp, s->seg[0].voff, SEEK_SET) < 0) error("Failed to seek %s.", s->fn[0]);
+        left = s->seg[0].bytes;
+    }
+
+    for (;;) {
+        struct fq_buf *b = &s->bufs[idx];
+        if (b->m - b->l < FQ_STREAM_BUF_SIZE/4) {
+            // buffer is (nearly) full, cut at the last line end and carry the tail
+            char *e = b->l ? memrchr(b->s, '\n', b->l) : NULL;
+            if (e == NULL) { // one line longer than the buffer
+                b->m <<= 1;
+                b->s = realloc(b->s, b->m);
+                continue;
+            }
+            int next = fq_stream_get_free(s);
+            if (next < 0) return NULL;
+            struct fq_buf *b1 = &s->bufs[next];
+            int l = b->s + b->l - (e+1);
+            if (b1->m < l + FQ_STREAM_BUF_SIZE/4) {
+                b1->m = l + FQ_STREAM_BUF_SIZE;
+                b1->s = realloc(b1->s, b1->m);
+            }
+            memcpy(b1->s, e+1, l);
+            b1->l = l;
+            b->l = e+1 - b->s;
+            fq_stream_put_full(s, idx);
+            idx = next;
+            continue;
+        }
+
+        size_t want = b->m - b->l;
+        if (left >= 0 && want > left) want = left;
+        int ret = want ? bgzf_read(s->fp, b->s + b->l, want) : 0;
+        if (ret < 0) error("Failed to decompress %s.", s->fn[curr]);
+        if (ret > 0) {
+            b->l += ret;
+            if (left > 0) left -= ret;
+            continue;
+        }
+        if (left > 0) error("Truncated %s, index may be out of date.", s->fn[curr]);
+        if (s->n_seg && ++i_seg < s->n_seg) {
+            if (bgzf_seek(s->fp, s->seg[i_seg].voff, SEEK_SET) < 0) error("Failed to seek %s.", s->fn[0]);
+            left = s->seg[i_seg].bytes;
+            continue;
+        }
+
+        // end of this file
+        if (b->l > 0 && b->s[b->l-1] != '\n') b->s[b->l++] = '\n';
+        bgzf_close(s->fp);
+        s->fp = NULL;
+        if (++curr == s->n_file) break;
+        s->fp = fq_stream_open_file(s->fn[curr]);
+        if (s->pool && bgzf_compression(s->fp) == bgzf)
+            bgzf_thread_pool(s->fp, s->pool, 256);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (s->bufs[idx].l > 0) {
+        s->full[(s->i_full + s->n_full) % FQ_STREAM_N_BUF] = idx;
+        s->n_full++;
+    } else {
+        s->free[(s->i_free + s->n_free) % FQ_STREAM_N_BUF] = idx;
+        s->n_free++;
+    }
+    s->eof = 1;
+    pthread_cond_signal(&s->not_empty);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void fq_stream_start(struct fq_stream *s, hts_tpool *pool)
+{
+    if (s->started) return;
+    s->pool = pool;
+    if (pool && bgzf_compression(s->fp) == bgzf)
+        bgzf_thread_pool(s->fp, pool, 256);
+    if (pthread_create(&s->tid, NULL, fq_stream_inflate, s))
+        error("Failed to create inflate thread.");
+    s->started = 1;
+}
+
+// reader side, give all buffers referred by last record back to inflate thread
+static void fq_stream_release(struct fq_stream *s)
+{
+    if (s->n_held == 0) return;
+    pthread_mutex_lock(&s->lock);
+    int i;
+    for (i = 0; i < s->n_held; ++i) {
+        s->bufs[s->held[i]].l = 0;
+        s->free[(s->i_free + s->n_free) % FQ_STREAM_N_BUF] = s->held[i];
+        s->n_free++;
+    }
+    pthread_cond_signal(&s->not_full);
+    pthread_mutex_unlock(&s->lock);
+    s->n_held = 0;
+}
+
+static void fq_stream_own(kstring_t *view, kstring_t *own)
+{
+    if (view->l == 0 || view->s == own->s) return;
+    own->l = 0;
+    kputsn(view->s, view->l, own);
+    view->s = own->s;
+}
+// record is longer than half of the ring, copy it out so the inflate thread will not starve
+static void fq_stream_detach(struct fq_stream *s)
+{
+    fq_stream_own(&s->name, &s->name0);
+    fq_stream_own(&s->seq, &s->seq0);
+    fq_stream_own(&s->qual, &s->qual0);
+    fq_stream_release(s);
+}
+// return length of next line, line end is replaced by '\0'; -1 on end of file
+static int fq_stream_getline(struct fq_stream *s, char **line)
+{
+    if (s->peek) {
+        *line = s->peek;
+        s->peek = NULL;
+        return s->l_peek;
+    }
+
+    if (s->cur == -1 || s->pos >= s->bufs[s->cur].l) {
+        if (s->n_held >= FQ_STREAM_N_BUF/2) fq_stream_detach(s);
+        if (s->cur != -1) s->held[s->n_held++] = s->cur;
+        s->cur = -1;
+        pthread_mutex_lock(&s->lock);
+        while (s->n_full == 0 && s->eof == 0)
+            pthread_cond_wait(&s->not_empty, &s->lock);
+        if (s->n_full > 0) {
+            s->cur = s->full[s->i_full];
+            s->i_full = (s->i_full + 1) % FQ_STREAM_N_BUF;
+            s->n_full--;
+        }
+        pthread_mutex_unlock(&s->lock);
+        if (s->cur == -1) return -1;
+        s->pos = 0;
+    }
+
+    struct fq_buf *b = &s->bufs[s->cur];
+    char *p = b->s + s->pos;
+    char *e = memchr(p, '\n', b->l - s->pos); // buffer always end with '\n'
+    int l = e - p;
+    *e = '\0';
+    if (l > 0 && p[l-1] == '\r') p[--l] = '\0';
+    s->pos = e + 1 - b->s;
+    *line = p;
+    return l;
+}
+
+static void fq_stream_append(kstring_t *view, kstring_t *own, char *line, int l)
+{
+    if (view->s != own->s) { // first line is a view, move it to own memory
+        own->l = 0;
+        kputsn(view->s, view->l, own);
+    }
+    kputsn(line, l, own);
+    view->s = own->s;
+    view->l = own->l;
+}
+// same return value with kseq_read()
+static int fq_stream_read(struct fq_stream *s)
+{
+    fq_stream_release(s);
+    s->name.l = s->seq.l = s->qual.l = 0;
+
+    char *line;
+    int l;
+    for (;;) {
+        l = fq_stream_getline(s, &line);
+        if (l < 0) return -1;
+        if (l > 0 && (line[0] == '@' || line[0] == '>')) break;
+    }
+
+    int i;
+    for (i = 1; i < l && !isspace(line[i]); ++i);
+    line[i] = '\0';
+    s->name.s = line + 1;
+    s->name.l = i - 1;
+
+    s->seq.s = NULL;
+    int is_fastq = 0;
+    for (;;) {
+        l = fq_stream_getline(s, &line);
+        if (l < 0) break;
+        if (l == 0) continue;
+        if (line[0] == '+') { is_fastq = 1; break; }
+        if (line[0] == '@' || line[0] == '>') {
+            s->peek = line;
+            s->l_peek = l;
+            break;
+        }
+        if (s->seq.s == NULL) {
+            s->seq.s = line;
+            s->seq.l = l;
+        }
+        else fq_stream_append(&s->seq, &s->seq0, line, l);
+    }
+    if (s->seq.s == NULL) s->seq.s = ""; // empty sequence
+    if (is_fastq == 0) return s->seq.l;
+
+    // read at least one quality line as kseq does, empty sequence has an empty quality line
+    l = fq_stream_getline(s, &line);
+    if (l < 0) return -2;
+    s->qual.s = line;
+    s->qual.l = l;
+    while (s->qual.l < s->seq.l) {
+        l = fq_stream_getline(s, &line);
+        if (l < 0) break;
+        fq_stream_append(&s->qual, &s->qual0, line, l);
+    }
+    if (s->seq.l != s->qual.l) return -2;
+    return s->seq.l;
+}
+
+static void fq_stream_destroy(struct fq_stream *s)
+{
+    if (s->started) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_broadcast(&s->not_full);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->tid, NULL);
+    }
+    if (s->fp) bgzf_close(s->fp);
+    int i;
+    for (i = 0; i < FQ_STREAM_N_BUF; ++i) free(s->bufs[i].s);
+    free(s->bufs);
+    free(s->full);
+    free(s->free);
+    free(s->held);
+    if (s->seg) free(s->seg);
+    if (s->name0.m) free(s->name0.s);
+    if (s->seq0.m) free(s->seq0.s);
+    if (s->qual0.m) free(s->qual0.s);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->not_empty);
+    pthread_cond_destroy(&s->not_full);
+    free(s);
+}
+
+static void fastq_handler_start(struct fastq_handler *h);
+
 int fastq_handler_read_one(struct fastq_handler *fastq)
 {
     if (fastq->closed) return -1;
-    int ret = kseq_read(fastq->k1);
+    if (fastq->started == 0) fastq_handler_start(fastq);
+    int ret = fq_stream_read(fastq->k1);
+    if (ret == -2) error("Truncated quality string.");
     if (ret < 0) {
         fastq->closed = 1;
         return ret;   
     }
 
-    if (fastq->k2 != NULL)
-        ret = kseq_read(fastq->k2);
-
-    if (fastq->k3 != NULL)
-        ret = kseq_read(fastq->k3);
-
-    if (fastq->k4 != NULL)
-        ret = kseq_read(fastq->k4);
+    struct fq_stream *mates[3] = { fastq->k2, fastq->k3, fastq->k4 };
+    int i;
+    for (i = 0; i < 3; ++i) {
+        if (mates[i] == NULL) continue;
+        ret = fq_stream_read(mates[i]);
+        if (ret == -2) error("Truncated quality string.");
+    }
     
     return ret;
 }
 
-static struct bseq_pool *fastq_read_smart(struct fastq_handler *h, int chunk_size)
+// check record number and byte budget of a chunk
+static inline int fastq_chunk_full(struct fastq_handler *h, struct bseq_pool *p, int64_t bytes)
 {
-    assert(chunk_size > 0);
-    struct bseq_pool *p = bseq_pool_init(chunk_size);
+    if (h->chunk_size > 0 && p->n >= h->chunk_size) return 1;
+    if (h->chunk_bytes > 0 && bytes >= h->chunk_bytes) return 1;
+    return 0;
+}
+static inline int fastq_chunk_init_size(struct fastq_handler *h)
+{
+    return h->chunk_size > 0 ? h->chunk_size : 1024;
+}
+static struct bseq_pool *fastq_read_smart(struct fastq_handler *h)
+{
+    struct bseq_pool *p = bseq_pool_get(fastq_chunk_init_size(h));
+    int64_t bytes = 0;
     int ret1= -1;
     do {
-        if (p->n == chunk_size) break;
+        if (fastq_chunk_full(h, p, bytes)) break;
         
-        ret1 = kseq_read(h->k1);
-    
-        if (ret1 < 0) { // come to the end of file
-            if (h->n_file > 1 && h->curr < h->n_file) {
-                gzclose(h->r1);
-                kseq_destroy(h->k1);
-                h->r1 = gzopen(h->read_1[h->curr], "r");
-                h->k1 = kseq_init(h->r1);
-                if (kseq_read(h->k1) < 0) error("Empty record ? %s", h->read_1[h->curr]);
-            }
-            else break;
-            h->curr++;
-        }
+        ret1 = fq_stream_read(h->k1);
+        if (ret1 == -2) error("Truncated quality string.");
+        if (ret1 < 0) break; // come to the end of file
 
-        kseq_t *ks = h->k1;
+        struct fq_stream *ks = h->k1;
         
-        struct bseq *s;
-        /*
-        if (p->n >= p->m ) {
-            p->m = p->m ? p->m*2 : 256;
-            p->s = realloc(p->s, p->m*sizeof(struct bseq));
-        }
-        */
-        s = &p->s[p->n];
+        struct bseq *s = bseq_pool_next(p);
 
         trim_read_tail(ks->name.s, ks->name.l);
-
-        bseq_unset(s);
         
         kstr_copy(&s->n0, &ks->name);
         kstr_copy(&s->s0, &ks->seq);
         kstr_copy(&s->q0, &ks->qual);
 
-        if ( kseq_read(ks) < 0 ) error("Truncated input.");
+        if ( fq_stream_read(ks) < 0 ) error("Truncated input.");
 
         trim_read_tail(ks->name.s, ks->name.l);
         
@@ -173,111 +609,70 @@ static struct bseq_pool *fastq_read_smart(struct fastq_handler *h, int chunk_siz
 
         kstr_copy(&s->s1, &ks->seq);
         kstr_copy(&s->q1, &ks->qual);
+        bytes += s->n0.l + (s->s0.l + s->s1.l)*2;
         
         p->n++;
     } while (1);
     
     if ( p->n == 0 ) {
-        bseq_pool_destroy(p);
+        bseq_pool_recycle(p);
         return NULL;
    }
     return p;
 }
-static struct bseq_pool *fastq_read_core(struct fastq_handler *h, int chunk_size, int pe)
+static struct bseq_pool *fastq_read_core(struct fastq_handler *h, int pe)
 {
-    assert(chunk_size > 0);
-    // k1 and k2 already load one record when come here
-    struct bseq_pool *p = bseq_pool_init(chunk_size);
+    struct bseq_pool *p = bseq_pool_get(fastq_chunk_init_size(h));
+    int64_t bytes = 0;
     int ret1, ret2 = -1;    
     if ( pe == 0 ) {
         do {
-            if (p->n == chunk_size) break;
+            if (fastq_chunk_full(h, p, bytes)) break;
             
-            ret1 = kseq_read(h->k1);
-            
-            if (ret1 < 0) { // come to the end of file
-                if (h->n_file > 1 && h->curr < h->n_file) {
-                    gzclose(h->r1);
-                    kseq_destroy(h->k1);
-                    h->r1 = gzopen(h->read_1[h->curr], "r");
-                    h->k1 = kseq_init(h->r1);
-                    if (kseq_read(h->k1) < 0) error("Empty record ? %s", h->read_1[h->curr]);
-                }
-                else break;
-                h->curr++;
-            }
-            /*
-            if (p->n >= p->m) {
-                p->m = p->m ? p->m<<1 : 256;
-                p->s = realloc(p->s, p->m*sizeof(struct bseq));
-            }
-            */
-            struct bseq *s = &p->s[p->n];
-            kseq_t *k1 = h->k1;
+            ret1 = fq_stream_read(h->k1);
+            if (ret1 == -2) error("Truncated quality string.");
+            if (ret1 < 0) break; // come to the end of file
+
+            struct bseq *s = bseq_pool_next(p);
+            struct fq_stream *k1 = h->k1;
             trim_read_tail(k1->name.s, k1->name.l);
-            bseq_unset(s);
             kstr_copy(&s->n0, &k1->name);
             kstr_copy(&s->s0, &k1->seq);
             kstr_copy(&s->q0, &k1->qual);
+            bytes += s->n0.l + s->s0.l*2;
             p->n++;
-            // if ( p->n >= chunk_size ) break;
         }
         while(1);
     }
     else {
         do {
             
-            if ( p->n == chunk_size ) break;
+            if (fastq_chunk_full(h, p, bytes)) break;
             
-            ret1 = kseq_read(h->k1);
-            ret2 = kseq_read(h->k2);
+            ret1 = fq_stream_read(h->k1);
+            ret2 = fq_stream_read(h->k2);
 
             int ret3 = -1;
             int ret4 = -1;
-            if (h->k3) ret3 = kseq_read(h->k3);
-            if (h->k4) ret4 = kseq_read(h->k4);
-            
+            if (h->k3) ret3 = fq_stream_read(h->k3);
+            if (h->k4) ret4 = fq_stream_read(h->k4);
+
+            if (ret1 == -2 || ret2 == -2 || ret3 == -2 || ret4 == -2)
+                error("Truncated quality string.");
+
             if (ret1 < 0) { // come to the end of file
                 if (ret2 >=0) error("Inconsistant input fastq records.");
                 if (ret3 >=0) error("Inconsistant input fastq records.");
                 if (ret4 >=0) error("Inconsistant input fastq records.");
-                
-                if (h->n_file > 1 && h->curr < h->n_file) {
-                    gzclose(h->r1);
-                    kseq_destroy(h->k1);
-                    h->r1 = gzopen(h->read_1[h->curr], "r");
-                    h->k1 = kseq_init(h->r1);
-                    if (kseq_read(h->k1) < 0) error("Empty record ? %s", h->read_1[h->curr]);
-                    if (h->r2) {
-                        gzclose(h->r2);
-                        kseq_destroy(h->k2);
-                        h->r2 = gzopen(h->read_2[h->curr], "r");
-                        h->k2 = kseq_init(h->r2);
-                        if (kseq_read(h->k2) < 0) error("Empty record ? %s", h->read_2[h->curr]);
-                    }
-                    if (h->r3) {
-                        gzclose(h->r3);
-                        kseq_destroy(h->k3);
-                        h->r3 = gzopen(h->read_3[h->curr], "r");
-                        h->k3 = kseq_init(h->r3);
-                        if (kseq_read(h->k3) < 0) error("Empty record ? %s", h->read_3[h->curr]);
-                    }
-                    if (h->r4) {
-                        gzclose(h->r4);
-                        kseq_destroy(h->k4);
-                        h->r4 = gzopen(h->read_4[h->curr], "r");
-                        h->k4 = kseq_init(h->r4);
-                        if (kseq_read(h->k4) < 0) error("Empty record ? %s", h->read_4[h->curr]);
-                    }
-                    
-                    h->curr++;
-                }
-                else break;
+                break;
             }
-            kseq_t *k1 = h->k1;
-            kseq_t *k2 = h->k2;
-            kseq_t *k3 = h->k3;
-            kseq_t *k4 = h->k4;
+            if (ret2 < 0 || (h->k3 && ret3 < 0) || (h->k4 && ret4 < 0))
+                error("Inconsistant input fastq records.");
+
+            struct fq_stream *k1 = h->k1;
+            struct fq_stream *k2 = h->k2;
+            struct fq_stream *k3 = h->k3;
+            struct fq_stream *k4 = h->k4;
             trim_read_tail(k1->name.s, k1->name.l);
             trim_read_tail(k2->name.s, k2->name.l);
 
@@ -289,9 +684,7 @@ static struct bseq_pool *fastq_read_core(struct fastq_handler *h, int chunk_size
             if (k4 && check_name(k1->name.s, k4->name.s) )
                 error("Inconsistance paired read names in the fourth fastq file. %s vs %s.", k1->name.s, k4->name.s);
             
-            struct bseq *s;
-            s = &p->s[p->n];
-            bseq_unset(s);
+            struct bseq *s = bseq_pool_next(p);
             kstr_copy(&s->n0, &k1->name);
             kstr_copy(&s->s0, &k1->seq);
             kstr_copy(&s->q0, &k1->qual);
@@ -306,13 +699,14 @@ static struct bseq_pool *fastq_read_core(struct fastq_handler *h, int chunk_size
                 kstr_copy(&s->s3, &k4->seq);
                 kstr_copy(&s->q3, &k4->qual);
             }
+            bytes += s->n0.l + (s->s0.l + s->s1.l + s->s2.l + s->s3.l)*2;
             
             p->n++;
         }
         while(1);
     }
     if ( p->n == 0 ) {
-        bseq_pool_destroy(p);
+        bseq_pool_recycle(p);
         return NULL;
     }
     return p;
@@ -322,11 +716,7 @@ static char **split_multi_files(const char *fname, int *n)
     kstring_t str = {0,0,0};
     kputs(fname, &str);
     int *s = ksplit(&str, ',', n);
-    if (*n == 1 || s == 0) {
-        free(str.s);
-        if (s) free(s);
-        return NULL;
-    }
+    if (s == 0) error("Empty file name.");
     
     char **paths = malloc(*n*sizeof(char*));
     int i;
@@ -346,84 +736,121 @@ struct fastq_handler *fastq_handler_init(const char *r1, const char *r2, const c
         h->read_2 = split_multi_files(r2, &n2);
         if (n1 != n2) error("Unpaired input fastqs.");
     }
+    if (r3 != NULL) {
+        h->read_3 = split_multi_files(r3, &n2);
+        if (n1 != n2) error("Unpaired input fastqs.");
+    }
+    if (r4 != NULL) {
+        h->read_4 = split_multi_files(r4, &n2);
+        if (n1 != n2) error("Unpaired input fastqs.");
+    }
     assert(n1 > 0);
     h->n_file = n1;
     h->curr = 1;
     h->smart_pair = smart;
     h->chunk_size = chunk_size;
 
-    if (n1 == 1) {
-        h->r1 = strcmp(r1, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(r1, "r");
-        if (h->r1 == NULL) error("Failed to open %s : %s.", r1, strerror(errno));
-        h->k1 = kseq_init(h->r1);
-        if (h->k1 == NULL) error("Failed to init stream. %s", r1);
-        
-        if (r2) {
-            h->r2 = gzopen(r2, "r");    
-            if (h->r2 == NULL) error("Failed to open %s: %s.", r2, strerror(errno));
-            h->k2 = kseq_init(h->r2);
-        }
+    h->k1 = fq_stream_init(h->read_1, n1);
+    if (r2) h->k2 = fq_stream_init(h->read_2, n1);
+    if (r3) h->k3 = fq_stream_init(h->read_3, n1);
+    if (r4) h->k4 = fq_stream_init(h->read_4, n1);
+    
+    return h;
+}
+// threads used to inflate BGZF blocks, shared by all input files; should be set before reading
+void fastq_handler_set_threads(struct fastq_handler *h, int n_thread)
+{
+    if (h->started) error("Try to set threads after reading started.");
+    h->n_thread = n_thread;
+}
+void fastq_handler_set_chunk_bytes(struct fastq_handler *h, int chunk_bytes)
+{
+    h->chunk_bytes = chunk_bytes;
+}
+int fastq_handler_select(struct fastq_handler *h, struct dict *list)
+{
+    if (h->started) error("Try to select blocks after reading started.");
+    if (h->n_file != 1 || h->k2 || h->smart_pair) error("Only one single-end FASTQ+ can be read by index.");
+    struct fq_stream *s = h->k1;
+    if (bgzf_compression(s->fp) != bgzf) error("%s is not BGZF compressed, cannot be read by index.", s->fn[0]);
 
-        if (r3) {
-            h->r3 = gzopen(r3, "r");    
-            if (h->r3 == NULL) error("Failed to open %s: %s.", r3, strerror(errno));
-            h->k3 = kseq_init(h->r3);
-        }
-        if (r4) {
-            h->r4 = gzopen(r4, "r");    
-            if (h->r4 == NULL) error("Failed to open %s: %s.", r4, strerror(errno));
-            h->k4 = kseq_init(h->r4);
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s%s", s->fn[0], FQ_INDEX_SUFFIX);
+    FILE *fp = fopen(str.s, "r");
+    if (fp == NULL) error("%s : %s. Index is created by fsort.", str.s, strerror(errno));
+
+    int m = 0, n_block = 0;
+    uint64_t records = 0;
+    int last = -2; // line of last selected block, to merge adjacent blocks into one range
+    int line;
+    for (line = 0; ; ++line) {
+        str.l = 0;
+        if (kgetline(&str, (kgets_func*)fgets, fp) < 0) break;
+        if (str.l == 0 || str.s[0] == '#') continue;
+        int n;
+        int *p = ksplit(&str, '\t', &n);
+        if (n < 4) error("Malformed index line %d, %s.", line+1, str.s);
+        // first tag value, then voffset, records and bytes at the end
+        if (dict_query(list, str.s+p[0]) >= 0) {
+            uint64_t voff = strtoull(str.s+p[n-3], NULL, 10);
+            uint64_t bytes = strtoull(str.s+p[n-1], NULL, 10);
+            if (last == line - 1) s->seg[s->n_seg-1].bytes += bytes;
+            else {
+                if (s->n_seg == m) {
+                    m = m == 0 ? 64 : m*2;
+                    s->seg = realloc(s->seg, m*sizeof(struct fq_seg));
+                }
+                s->seg[s->n_seg].voff = voff;
+                s->seg[s->n_seg].bytes = bytes;
+                s->n_seg++;
+            }
+            records += strtoull(str.s+p[n-2], NULL, 10);
+            n_block++;
+            last = line;
         }
+        free(p);
     }
-    else {
-        h->r1 = gzopen(h->read_1[0], "r");
-        h->k1 = kseq_init(h->r1);
-        if (r2) {
-            h->r2 = gzopen(h->read_2[0], "r");
-            h->k2 = kseq_init(h->r2);
-        }
-        if (r3) {
-            h->r3 = gzopen(h->read_3[0], "r");
-            h->k3 = kseq_init(h->r3);
-        }
-        if (r4) {
-            h->r4 = gzopen(h->read_4[0], "r");
-            h->k4 = kseq_init(h->r4);
-        }
+    fclose(fp);
+    free(str.s);
+    if (n_block == 0) {
+        warnings("No block found in index of %s.", s->fn[0]);
+        // an empty range, so nothing is read
+        s->seg = malloc(sizeof(struct fq_seg));
+        s->seg[0].voff = s->seg[0].bytes = 0;
+        s->n_seg = 1;
     }
-    
-    return h;
+    LOG_print("Select %d blocks, %" PRIu64 " records in %d ranges.", n_block, records, s->n_seg);
+    return n_block;
+}
+static void fastq_handler_start(struct fastq_handler *h)
+{
+    if (h->n_thread > 1) h->pool = hts_tpool_init(h->n_thread);
+    fq_stream_start(h->k1, h->pool);
+    if (h->k2) fq_stream_start(h->k2, h->pool);
+    if (h->k3) fq_stream_start(h->k3, h->pool);
+    if (h->k4) fq_stream_start(h->k4, h->pool);
+    h->started = 1;
 }
 
 void fastq_handler_destory(struct fastq_handler *h)
 {
-    kseq_destroy(h->k1);
-    gzclose(h->r1);
-    if ( h->k2 ) {
-        kseq_destroy(h->k2);
-        gzclose(h->r2);
-    }
-    if ( h->k3 ) {
-        kseq_destroy(h->k3);
-        gzclose(h->r3);
-    }
-    if ( h->k4 ) {
-        kseq_destroy(h->k4);
-        gzclose(h->r4);
-    }
-    if (h->n_file > 1) {
-        int i;
-        for (i = 0; i < h->n_file;++i) {
-            free(h->read_1[i]);
-            if (h->read_2) free(h->read_2[i]);
-            if (h->read_3) free(h->read_3[i]);
-            if (h->read_4) free(h->read_4[i]);
-        }
-        free(h->read_1);
-        if (h->read_2) free(h->read_2);
-        if (h->read_3) free(h->read_3);
-        if (h->read_4) free(h->read_4);
+    fq_stream_destroy(h->k1);
+    if (h->k2) fq_stream_destroy(h->k2);
+    if (h->k3) fq_stream_destroy(h->k3);
+    if (h->k4) fq_stream_destroy(h->k4);
+    if (h->pool) hts_tpool_destroy(h->pool);
+
+    int i;
+    for (i = 0; i < h->n_file;++i) {
+        free(h->read_1[i]);
+        if (h->read_2) free(h->read_2[i]);
+        if (h->read_3) free(h->read_3[i]);
+        if (h->read_4) free(h->read_4[i]);
     }
+    free(h->read_1);
+    if (h->read_2) free(h->read_2);
+    if (h->read_3) free(h->read_3);
+    if (h->read_4) free(h->read_4);
     free(h);
 }
 int fastq_handler_state(struct fastq_handler *h)
@@ -441,18 +868,21 @@ void *fastq_read(void *_h, void *opts)
     int state = fastq_handler_state(h);
 
     struct bseq_pool *b;
+
+    if (h->started == 0 && state != FH_NOT_ALLOC && state != FH_NOT_INIT)
+        fastq_handler_start(h);
     
     switch(state) {
         case FH_SE:
-            b = fastq_read_core(h, h->chunk_size, 0);
+            b = fastq_read_core(h, 0);
             break;
             
         case FH_PE:
-            b = fastq_read_core(h, h->chunk_size, 1);
+            b = fastq_read_core(h, 1);
             break;
             
         case FH_SMART_PAIR:
-            b = fastq_read_smart(h, h->chunk_size);
+            b = fastq_read_smart(h);
             break;
 
         case FH_NOT_ALLOC:
@@ -498,12 +928,8 @@ KHASH_MAP_INIT_STR(key, struct hvals*)
 void bseq_pool_push(struct bseq *b, struct bseq_pool *p)
 {
     assert(p);
-    if (p->n == p->m) {
-        p->m = p->m == 0 ? 10 : p->m<<1;
-        p->s = realloc(p->s, sizeof(struct bseq)*p->m);               
-    }
-    struct bseq *c = &p->s[p->n++];
-    bseq_unset(c);
+    struct bseq *c = bseq_pool_next(p);
+    p->n++;
     c->flag = b->flag;
     kputs(b->n0.s, &c->n0);
     kputs(b->s0.s, &c->s0);
@@ -865,27 +1291,15 @@ void bseq_pool_write_file(struct bseq_pool *p, const char *fn)
 
 struct bseq_pool *bseq_pool_cache_fastq(FILE *fp, int n)
 {
-    struct bseq_pool *p = bseq_pool_init(n);
+    struct bseq_pool *p = bseq_pool_get(n);
     
     for (;;) {
-
-        if (n > 0) {
-            if (p->n == n) break;
-            if (p->m == 0) {
-                p->m = n;
-                p->s = malloc(sizeof(struct bseq)*p->m);
-            }
-        } else {
-            if (p->n == p->m) {
-                p->m = p->m == 0 ? 4 : p->m *2;
-                p->s = realloc(p->s, sizeof(struct bseq)*p->m);
-            }
-        }
+        if (n > 0 && p->n == n) break;
         
         int l = 0;
-        struct bseq *b = &p->s[p->n];
-        bseq_unset(b);
+        struct bseq *b = bseq_pool_next(p);
         char c = fgetc(fp);
+        if (c == EOF) break; // end of last record
         assert(c == '@');
 
         for (;;) { // fastq name
@@ -950,24 +1364,12 @@ struct bseq_pool *bseq_pool_cache_fastq(FILE *fp, int n)
 }
 struct bseq_pool *bseq_pool_cache_fasta(FILE *fp, int n)
 {
-    struct bseq_pool *p = bseq_pool_init(n);
+    struct bseq_pool *p = bseq_pool_get(n);
     
     for (;;) {
-        if (n > 0) {
-            if (p->n == n) break;
-            if (p->n == 0) {
-                p->m = n;
-                p->s = malloc(sizeof(struct bseq)*p->m);
-            }
-        } else {
-            if (p->n == p->m) {
-                p->m = p->m == 0 ? 4 : p->m *2;
-                p->s = realloc(p->s, sizeof(struct bseq)*p->m);
-            }
-        }
+        if (n > 0 && p->n == n) break;
        
-        struct bseq *b = &p->s[p->n];
-        bseq_unset(b);
+        struct bseq *b = bseq_pool_next(p);
         
         char c = fgetc(fp);
         assert(c == '>');
@@ -1023,10 +1425,21 @@ struct bseq_pool *bseq_pool_cache_file(const char *fn)
     return p;
 }
 
+// copy current record to b and read ahead, return 1 on end of file
+static int fastq_take_one(struct fastq_handler *fastq, struct bseq *b)
+{
+    struct fq_stream *ks = fastq->k1;
+    trim_read_tail(ks->name.s, ks->name.l);
+    kstr_copy(&b->n0, &ks->name);
+    kstr_copy(&b->s0, &ks->seq);
+    kstr_copy(&b->q0, &ks->qual);
+    
+    return fastq_handler_read_one(fastq) < 0;
+}
 struct bseq *fastq_read_one(struct fastq_handler *fastq)
 {
     if (fastq->closed == 1) return NULL;
-    kseq_t *ks = fastq->k1;
+    struct fq_stream *ks = fastq->k1;
     if (ks->name.l == 0) {
         int ret = fastq_handler_read_one(fastq);
         if (ret < 0) {
@@ -1035,14 +1448,7 @@ struct bseq *fastq_read_one(struct fastq_handler *fastq)
         }
     }
     struct bseq *b = bseq_init();
-    ks = fastq->k1;
-    trim_read_tail(ks->name.s, ks->name.l);
-    kstr_copy(&b->n0, &ks->name);
-    kstr_copy(&b->s0, &ks->seq);
-    kstr_copy(&b->q0, &ks->qual);
-    
-    fastq_handler_read_one(fastq);
-   
+    fastq_take_one(fastq, b);
     return b;
 }
 
@@ -1052,7 +1458,7 @@ struct bseq *fastq_read_one(struct fastq_handler *fastq)
 int compare_block(char**vals, int n, struct fastq_handler *fastq, struct dict *tags)
 {
     if (fastq->closed) return -1;
-    kseq_t *ks = fastq->k1;
+    struct fq_stream *ks = fastq->k1;
     if (ks->name.l == 0) return -1;
     char **v1 = fname_pick_tags(ks->name.s, tags);
     
@@ -1070,28 +1476,31 @@ struct bseq_pool *fastq_read_block(struct fastq_handler *fastq, struct dict *tag
 {
     if (fastq->closed == 1) return NULL;
     assert(tags);
-    struct bseq *b = fastq_read_one(fastq);
-    if (b == NULL) {
-        fastq->closed = 1;
-        return NULL;
+    struct fq_stream *ks = fastq->k1;
+    if (ks->name.l == 0) {
+        if (fastq_handler_read_one(fastq) < 0) {
+            fastq->closed = 1;
+            return NULL;
+        }
     }
 
-    struct bseq_pool *p = bseq_pool_init(2);
+    // records are read into recycled pool directly
+    struct bseq_pool *p = bseq_pool_get(2);
+    struct bseq *b = bseq_pool_next(p);
+    fastq_take_one(fastq, b);
+    p->n++;
 
     char **vals = fname_pick_tags(b->n0.s, tags);
     p->opts = vals;
     //debug_print("%s", b->n0.s);
-    bseq_pool_push(b, p);
-    bseq_destroy(b);
     
     int n = dict_size(tags);
     for (;;) {
         int ret = compare_block(vals, n, fastq, tags);
         if (ret == 1) break; // diff
         if (ret == -1) break; // end of file
-        struct bseq *b1 = fastq_read_one(fastq);
-        bseq_pool_push(b1, p);
-        bseq_destroy(b1);
+        fastq_take_one(fastq, bseq_pool_next(p));
+        p->n++;
     }
     return p;
 }
@@ -42,6 +42,7 @@ struct bseq_pool {
     struct bseq *s;
     int force_fasta;
     void *opts; // used to point thread safe structure
+    int n_alloc; // records below this are initialised and may keep memory from last use
 };
 
 struct fastq_handler {
@@ -51,17 +52,17 @@ struct fastq_handler {
     char **read_2;
     char **read_3;
     char **read_4;
-    gzFile r1;
-    gzFile r2;
-    gzFile r3;
-    gzFile r4;
-    void *k1;
+    void *k1; // decompression stream of each read, see fastq.c
     void *k2;
     void *k3;
     void *k4;
     int smart_pair;
     int chunk_size;
+    int chunk_bytes; // stop a chunk once this many bytes are read, 0 for chunk_size records only
     int closed;
+    int n_thread; // threads to inflate BGZF blocks
+    int started;
+    void *pool;
 };
 
 #define FH_SE 1
@@ -81,6 +82,15 @@ void bseq_pool_clean(struct bseq_pool *p);
 
 void bseq_pool_destroy(struct bseq_pool *p);
 
+// Pools are recycled through a free list shared by all threads. The writer returns a pool by
+// bseq_pool_recycle() and the reader takes it back by bseq_pool_get(), records keep their buffers.
+struct bseq_pool *bseq_pool_get(int size);
+void bseq_pool_recycle(struct bseq_pool *p);
+void bseq_pool_free_list_destroy();
+
+// return next record of pool, emptied but keep capacity. p->n is not increased.
+struct bseq *bseq_pool_next(struct bseq_pool *p);
+
 // fastq handler must be inited before call fastq_read
 void *fastq_read(void *h, void *opts);
 
@@ -88,6 +98,22 @@ extern struct fastq_handler *fastq_handler_init(const char *r1, const char *r2,
                                                 const char *r3, const char *r4,
                                                 int smart, int chunk_size);
 
+extern void fastq_handler_set_threads(struct fastq_handler *h, int n_thread);
+
+// default byte budget of one chunk, keep chunks of long and short reads in similar size
+#define FQ_CHUNK_BYTES 0x100000
+
+extern void fastq_handler_set_chunk_bytes(struct fastq_handler *h, int chunk_bytes);
+
+// Sidecar index of FASTQ+ sorted by fsort, one line per read block : tag values, BGZF virtual
+// offset, records and bytes. Named by appending the suffix to the FASTQ+ file name.
+#define FQ_INDEX_SUFFIX ".fbi"
+
+// Only read blocks of which the first tag value is in list, adjacent blocks are read as one range.
+// Input should be a single BGZF file indexed by fsort. Should be called before reading, return
+// number of blocks selected.
+extern int fastq_handler_select(struct fastq_handler *h, struct dict *list);
+
 extern int fastq_handler_state(struct fastq_handler*);
 
 extern void fastq_handler_destory(struct fastq_handler *h);
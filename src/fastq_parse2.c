@@ -3,11 +3,22 @@
 #include "dict.h"
 #include "htslib/thread_pool.h"
 #include "htslib/kstring.h"
+#include "htslib/bgzf.h"
+#include "htslib/sam.h"
+#include "htslib/hts_endian.h"
 #include "number.h"
 #include "read_tags.h"
-#ifdef _OPENMP
-#include <omp.h>
-#endif
+#include "bc_hash.h"
+#include "sim_search.h"
+#include "bc_count.h"
+#include "qual_stat.h"
+#include <pthread.h>
+
+struct out_file {
+    char *fname;
+    FILE *fp;
+    BGZF *bgzf; // BGZF compressed output, if file name ends with .gz or .bam
+};
 
 static struct args {
     const char *r1_fname;
@@ -20,8 +31,12 @@ static struct args {
 
     const char *out1_fname;
     const char *out2_fname;
-    FILE *fp_out1;
-    FILE *fp_out2;
+    int n_shard;
+    int n_out; // n_shard outputs for each sample
+    struct out_file *out1; // one file per shard
+    struct out_file *out2; // NULL if read 2 is not written separately
+    hts_tpool *out_pool; // compress all BGZF outputs
+    int ubam; // write unaligned BAM, barcodes are kept in aux fields
     
     const char *parse_rules;
     int n_bc;
@@ -29,14 +44,30 @@ static struct args {
 
     struct bc_reg *r1;
     struct bc_reg *r2;
+
+    // sample demultiplexing, reads are written to outputs of their sample
+    int demux; // index of sample tag in bcs, -1 for no demultiplexing
+    int n_sample; // barcodes in sample white list, plus undetermined
+    char **samples;
+    uint64_t *sample_reads;
     
     int n_thread;
     int smart_pair;
     int qual_thres;
     int dropN;
-    int chunk_size;
+    int chunk_size; // records per chunk, 0 for byte budget only
     int order;
     int no_warnings;
+    // cell barcode counts, one counter per worker thread
+    const char *cbdis_fname;
+    int cbdis_top; // keep top barcodes in sketch, 0 for exact counting
+    const char *cb_tag; // cell barcode tag for -cbdis and -shards, raw or corrected tag of a rule
+    int cb_rule; // index of cell barcode rule in bcs, -1 if not used
+    pthread_mutex_t count_lock;
+    int n_count;
+    struct bc_count **counts;
+    int n_cell; // estimated by knee, -1 if not estimated
+    struct qual_stat *qs; // one per barcode tag, the last one for reads
     // stats of reads
     uint64_t raw_reads;
     uint64_t reads_pass_qc;
@@ -53,19 +84,35 @@ static struct args {
     .fp_report   = NULL,
     .out1_fname  = NULL,
     .out2_fname  = NULL,
-    .fp_out1     = NULL,
-    .fp_out2     = NULL,
+    .n_shard     = 1,
+    .n_out       = 1,
+    .out1        = NULL,
+    .out2        = NULL,
+    .out_pool    = NULL,
     
     .parse_rules = NULL,
     .n_bc        = 0,
     .bcs         = NULL,
     .r1          = NULL,
     .r2          = NULL,
+    .demux       = -1,
+    .n_sample    = 1,
+    .samples     = NULL,
+    .sample_reads= NULL,
     .smart_pair  = 0,
-    .qual_thres  = 20,
+    .qual_thres  = 0,
     .order       = 0,
     .dropN       = 0,
-    .chunk_size  = 1000,
+    .cbdis_fname = NULL,
+    .cbdis_top   = 0,
+    .cb_tag      = NULL,
+    .cb_rule     = -1,
+    .count_lock  = PTHREAD_MUTEX_INITIALIZER,
+    .n_count     = 0,
+    .counts      = NULL,
+    .n_cell      = -1,
+    .qs          = NULL,
+    .chunk_size  = 0,
     .n_thread    = 4,
     .raw_reads   = 0,
     .reads_pass_qc = 0,
@@ -78,13 +125,19 @@ struct bc_reg0 {
     int rd;
     int st; // 0 offset
     int ed; // 1 offset
-    struct dict *wl;
+    int mis; // allow mismatches, or edit distance if indel set
+    int indel;
+    int n_wl; // barcodes in white list
+    struct bc_hash *bh; // packed white list
+    ss_t *ss; // candidate index for more than one mismatch or indels
+    struct dict *wl; // white list with mismatch variants, only used if barcodes cannot be packed
 };
 
 struct bc_reg {
     int n;
     char *raw_tag;
     char *corr_tag;
+    int demux; // sample tag
     struct bc_reg0 *r;
 };
 struct dict *build_mis(struct dict *wl)
@@ -128,98 +181,118 @@ struct dict *read_wl(const char *fn, int mis)
 
     return build_mis(wl);
 }
-struct dict *read_wl_cached(const char **bcs, int l, int mis)
+static void load_wl(struct bc_reg0 *r0, const char *fn, int mis, int indel)
 {
-    struct dict *wl = dict_init();
-    int i;
-    for (i = 0; i < l;i++) {
-        // if (bcs[i] == NULL) continue;
-        dict_push(wl, bcs[i]);
+    r0->mis = mis;
+    r0->indel = indel;
+    // precompiled by `PISA wlindex`
+    r0->bh = bc_hash_load(fn);
+    if (r0->bh == NULL) {
+        r0->bh = bc_hash_init();
+        if (bc_hash_read(r0->bh, fn)) {
+            bc_hash_destroy(r0->bh);
+            r0->bh = NULL;
+            if (mis > 1 || indel) error("Barcodes in %s should be fixed length ACGT strings to correct more than one mismatch or indels.", fn);
+            if (args.no_warnings == 0)
+                warnings("Barcodes in %s are not fixed length ACGT strings (max %d bp), use slow mode.", fn, BC_HASH_MAX_LENGTH);
+            r0->wl = read_wl(fn, 0);
+            r0->n_wl = dict_size(r0->wl);
+            if (mis) build_mis(r0->wl);
+            return;
+        }
     }
-    if (mis == 0) return wl;
-    return build_mis(wl);
-}
+    r0->n_wl = r0->bh->n;
+    if (mis <= 1 && indel == 0) return;
 
-void bseq_subset_str0(kstring_t *from, kstring_t *to, int st, int ed)
-{
-    if (st == -1) kputs(from->s, to);
-    else if (ed == -1) kputs(from->s+st, to);
-    else {
-        kputsn(from->s+st, ed - st, to);
-        kputs("", to);
+    r0->ss = ss_init();
+    char s[BC_HASH_MAX_LENGTH+1];
+    s[r0->bh->len] = '\0';
+    uint32_t i;
+    for (i = 0; i < r0->bh->n; ++i) {
+        bc_hash_decode(r0->bh, i, s);
+        ss_push(r0->ss, s);
     }
+    ss_build(r0->ss, mis);
 }
-char *bseq_subset_seq(struct bseq *b, int rd, int st, int ed)
+static void load_wl_cached(struct bc_reg0 *r0, const char **bcs, int l, int mis)
 {
-    kstring_t str = {0,0,0};
-    
-    if (rd == 1) {
-        kstring_t *from = &b->s0;
-        bseq_subset_str0(from, &str, st, ed);
-    } else if (rd == 2) {
-        kstring_t *from = &b->s1;
-        bseq_subset_str0(from, &str, st, ed);
-    } else if (rd == 3) {
-        kstring_t *from = &b->s2;
-        bseq_subset_str0(from, &str, st, ed);
-    } else if (rd == 4) {
-        kstring_t *from = &b->s3;
-        bseq_subset_str0(from, &str, st, ed);        
-    } else {
-        error("Only support 1-4 read files now.");
+    r0->mis = mis;
+    r0->bh = bc_hash_init();
+    int i;
+    for (i = 0; i < l; i++) {
+        if (bc_hash_push(r0->bh, bcs[i], strlen(bcs[i])) < 0) error("Failed to load barcode %s.", bcs[i]);
     }
-    return str.s;
+    r0->n_wl = r0->bh->n;
 }
-char *bseq_subset_qual(struct bseq *b, int rd, int st, int ed)
+
+// segment of a read, points into the bseq buffers, no copy
+struct bseq_seg {
+    const char *s;
+    const char *q; // NULL for FASTA
+    int l;
+};
+
+static void bseq_segment(struct bseq *b, struct bc_reg0 *r0, struct bseq_seg *v)
 {
-    kstring_t str = {0,0,0};
-    if (rd == 1) {
-        if (b->q0.l == 0) return NULL; 
-        kstring_t *from = &b->q0;
-        bseq_subset_str0(from, &str, st, ed);
-    } else if (rd == 2) {
-        if (b->q1.l == 0) return NULL; 
-        kstring_t *from = &b->q1;
-        bseq_subset_str0(from, &str, st, ed);
-    } else if (rd == 3) {
-        if (b->q2.l == 0) return NULL; 
-        kstring_t *from = &b->q2;
-        bseq_subset_str0(from, &str, st, ed);
-    } else if (rd == 4) {
-        if (b->q3.l == 0) return NULL; 
-        kstring_t *from = &b->q3;
-        bseq_subset_str0(from, &str, st, ed);
-    } else {
-        error("Only support 1-4 read files now.");
+    kstring_t *s, *q;
+    switch (r0->rd) {
+        case 1: s = &b->s0; q = &b->q0; break;
+        case 2: s = &b->s1; q = &b->q1; break;
+        case 3: s = &b->s2; q = &b->q2; break;
+        case 4: s = &b->s3; q = &b->q3; break;
+        default: error("Only support 1-4 read files now.");
     }
-    return str.s;
+    int st = r0->st < 0 ? 0 : r0->st;
+    int ed = r0->ed < 0 || r0->ed > s->l ? s->l : r0->ed;
+    if (st > ed) st = ed;
+    v->s = s->s + st;
+    v->q = q->l ? q->s + st : NULL;
+    v->l = ed - st;
 }
-char *correct_bc(struct dict *wl, const char *val, int *exact)
+// put corrected barcode to corr, return index of barcode in white list, or -1 if not in white list
+static int correct_bc(struct bc_reg0 *r0, struct bseq_seg *v, kstring_t *seg, kstring_t *corr, int *exact)
 {
     *exact = 0;
-    int idx = dict_query(wl, val);
-    if (idx >= 0) {
+    int idx;
+    if (r0->bh) {
+        // exact match or one mismatch by packed hash, others by candidate index
+        idx = bc_hash_query(r0->bh, v->s, v->l, r0->ss ? 0 : r0->mis, exact);
+        if (idx >= 0) {
+            ks_resize(corr, corr->l + r0->bh->len + 1);
+            corr->l += bc_hash_decode(r0->bh, idx, corr->s + corr->l);
+            corr->s[corr->l] = '\0';
+            return idx;
+        }
+        if (r0->ss == NULL) return -1;
+        int dist;
+        idx = ss_query2(r0->ss, v->s, v->l, r0->mis, r0->indel, &dist);
+        if (idx < 0) return -1;
+        ks_resize(corr, corr->l + r0->bh->len + 1);
+        corr->l += ss_decode(r0->ss, idx, corr->s + corr->l);
+        corr->s[corr->l] = '\0';
+        return idx;
+    }
+
+    seg->l = 0;
+    kputsn(v->s, v->l, seg);
+    idx = dict_query(r0->wl, seg->s);
+    if (idx >= 0 && dict_query2(r0->wl, seg->s) == idx) { // mismatch variants point to other keys
         *exact = 1;
-        return dict_name(wl, idx); // Exactly match
-    } else {
-        *exact = 0;
-        int j;
-        int l = strlen(val);
-        kstring_t str= {0, 0, 0};
-        kputs(val, &str);
-        for (j = 0; j < l; ++j) {
-            char o = str.s[j];
-            str.s[j] = 'N';
-            idx = dict_query2(wl, str.s);
-            if (idx > 0) {
-                free(str.s);
-                return dict_name(wl, idx);
-            }
-            str.s[j] = o;
+        kputs(dict_name(r0->wl, idx), corr); // Exactly match
+        return idx;
+    }
+    int j;
+    for (j = 0; j < seg->l; ++j) {
+        char o = seg->s[j];
+        seg->s[j] = 'N';
+        idx = dict_query2(r0->wl, seg->s);
+        seg->s[j] = o;
+        if (idx >= 0) {
+            kputs(dict_name(r0->wl, idx), corr);
+            return idx;
         }
-        free(str.s);        
     }
-    return NULL;
+    return -1;
 }
 int parse_region(const char *_s, struct bc_reg *r)
 {
@@ -267,10 +340,15 @@ int merge_bcs(struct bc_reg *bcs, int n0)
     for (i = 0; i < n0; ++i) {
         struct bc_reg *b = &bcs[i];       
         if (strcmp(b->raw_tag, b0->raw_tag) == 0) {
+            if (b->demux || b0->demux) error("Sample tag %s should be one segment.", b->raw_tag);
             b->r = realloc(b->r, (b->n+1)*sizeof(struct bc_reg0));
             b->r[b->n].rd = b0->r[0].rd;
             b->r[b->n].st = b0->r[0].st;
             b->r[b->n].ed = b0->r[0].ed;
+            b->r[b->n].mis = b0->r[0].mis;
+            b->r[b->n].indel = b0->r[0].indel;
+            b->r[b->n].bh = b0->r[0].bh;
+            b->r[b->n].ss = b0->r[0].ss;
             b->r[b->n].wl = b0->r[0].wl;
             b->n++;
 
@@ -334,13 +412,25 @@ void parse_rules(const char *rule)
             r->raw_tag = strdup(temp.s);
             if (parse_region(temp.s+s0[1], r)) error("Unrecognised rule format.");
 
-            int mis = 0;
+            int mis = 0, indel = 0;
             if (n1 >=4) {                
                 if (strlen(temp.s+s0[3]) != 2) error("Unrecognised rule format.");
-                if (*(temp.s+s0[4]) == '1') mis = 1;
+                if (n1 >= 5) {
+                    // distance, such as 1, 2, or 1i for edit distance
+                    char *d = temp.s+s0[4];
+                    if (!isdigit(d[0]) || (d[1] != '\0' && (d[1] != 'i' || d[2] != '\0')))
+                        error("Unrecognised distance %s, should be like 1, 2 or 1i.", d);
+                    mis = d[0] - '0';
+                    indel = d[1] == 'i';
+                    if (mis > 3) error("Allow 3 distance at max.");
+                }
                 r->corr_tag = strdup(temp.s+s0[3]);
                 struct bc_reg0 *r0 = &r->r[0];
-                r0->wl = read_wl(temp.s+s0[2], mis);
+                load_wl(r0, temp.s+s0[2], mis, indel);
+            }
+            if (n1 >= 6) {
+                if (strcmp(temp.s+s0[5], "sample") != 0) error("Unrecognised rule format. Only \"sample\" is allowed after distance.");
+                r->demux = 1;
             }
 
             free(temp.s);
@@ -352,6 +442,138 @@ void parse_rules(const char *rule)
     args.n_bc = n0;
     free(s);
     free(str.s);
+
+    for (i = 0; i < n0; ++i) {
+        if (args.bcs[i].demux == 0) continue;
+        if (args.demux != -1) error("Only one sample tag is allowed.");
+        args.demux = i;
+    }
+}
+// output names of samples, barcodes of white list in order, and undetermined
+static void load_samples()
+{
+    struct bc_reg0 *r0 = &args.bcs[args.demux].r[0];
+    args.n_sample = r0->n_wl + 1;
+    args.samples = malloc(args.n_sample*sizeof(char*));
+    int i;
+    for (i = 0; i < r0->n_wl; ++i) {
+        if (r0->bh) {
+            args.samples[i] = malloc(r0->bh->len+1);
+            args.samples[i][bc_hash_decode(r0->bh, i, args.samples[i])] = '\0';
+        }
+        else args.samples[i] = strdup(dict_name(r0->wl, i));
+    }
+    args.samples[i] = strdup("undetermined");
+    args.sample_reads = calloc(args.n_sample, sizeof(uint64_t));
+}
+static int is_gz_fname(const char *fn)
+{
+    int l = strlen(fn);
+    return l > 3 && strcmp(fn+l-3, ".gz") == 0;
+}
+static int is_bam_fname(const char *fn)
+{
+    int l = strlen(fn);
+    return l > 4 && strcmp(fn+l-4, ".bam") == 0;
+}
+static void write_ubam_header(BGZF *fp, int argc, char **argv)
+{
+    kstring_t str = {0,0,0};
+    kputs("@HD\tVN:1.6\tSO:unsorted\n@PG\tID:PISA\tPN:PISA\tCL:PISA parse", &str);
+    int i;
+    for (i = 1; i < argc; ++i) {
+        kputc(' ', &str);
+        kputs(argv[i], &str);
+    }
+    kputc('\n', &str);
+    sam_hdr_t *h = sam_hdr_init();
+    if (h == NULL || sam_hdr_add_lines(h, str.s, str.l)) error("Failed to create BAM header.");
+    if (bam_hdr_write(fp, h)) error("Failed to write BAM header.");
+    sam_hdr_destroy(h);
+    free(str.s);
+}
+static void open_out(struct out_file *f, char *fn)
+{
+    f->fname = fn;
+    if (is_bam_fname(fn) || is_gz_fname(fn)) {
+        f->bgzf = bgzf_open(fn, "w");
+        if (f->bgzf == NULL) error("%s: %s.", fn, strerror(errno));
+        // all shards share one thread pool
+        if (args.out_pool) bgzf_thread_pool(f->bgzf, args.out_pool, 256);
+    }
+    else {
+        f->fp = fopen(fn, "w");
+        if (f->fp == NULL) error("%s: %s.", fn, strerror(errno));
+    }
+}
+static void close_out(struct out_file *f)
+{
+    if (f->bgzf && bgzf_close(f->bgzf)) error("Failed to close %s.", f->fname);
+    if (f->fp && f->fp != stdout) fclose(f->fp);
+    free(f->fname);
+}
+// out.fq.gz to out_07.fq.gz, or out_ACGTACGT_07.fq.gz with sample, sample name and shard number are
+// inserted before extensions of file name
+static char *shard_fname(const char *fn, const char *sample, int i, int n)
+{
+    const char *base = strrchr(fn, '/');
+    base = base ? base + 1 : fn;
+    const char *ext = strchr(base, '.');
+    if (ext == NULL) ext = fn + strlen(fn);
+    int w = 1, k;
+    for (k = n - 1; k >= 10; k /= 10) w++;
+    kstring_t str = {0,0,0};
+    kputsn(fn, ext - fn, &str);
+    if (sample) ksprintf(&str, "_%s", sample);
+    if (n > 1) ksprintf(&str, "_%0*d", w, i);
+    kputs(ext, &str);
+    return str.s;
+}
+// outputs of sample i are f[i*n_shard] to f[(i+1)*n_shard-1]
+static struct out_file *open_outs(const char *fn)
+{
+    struct out_file *f = malloc(args.n_out*sizeof(struct out_file));
+    memset(f, 0, args.n_out*sizeof(struct out_file));
+    int i;
+    for (i = 0; i < args.n_out; ++i) {
+        const char *sample = args.samples ? args.samples[i/args.n_shard] : NULL;
+        open_out(&f[i], args.n_out == 1 ? strdup(fn) : shard_fname(fn, sample, i%args.n_shard, args.n_shard));
+    }
+    return f;
+}
+// cell barcode rule for -cbdis and -shards, set by -cb-tag or the only rule with white list and
+// corrected tag, sample tag is not counted
+static void select_cb_rule()
+{
+    int i;
+    for (i = 0; i < args.n_bc; ++i) {
+        struct bc_reg *r = &args.bcs[i];
+        if (args.cb_tag) {
+            if ((r->raw_tag && strcmp(r->raw_tag, args.cb_tag) == 0) ||
+                (r->corr_tag && strcmp(r->corr_tag, args.cb_tag) == 0)) {
+                args.cb_rule = i;
+                break;
+            }
+            continue;
+        }
+        if (r->corr_tag == NULL || r->demux) continue;
+        if (args.cb_rule != -1) error("More than one tag is corrected by white list, set cell barcode tag by -cb-tag.");
+        args.cb_rule = i;
+    }
+    if (args.cb_rule != -1) return;
+    if (args.cb_tag) error("No rule for tag %s.", args.cb_tag);
+    error("No tag is corrected by white list for -cbdis or -shards, set cell barcode tag by -cb-tag.");
+}
+// shard of read is decided by hash of the cell barcode, FNV-1a
+static inline int shard_of(const char *s, int l)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = 0; i < l; ++i) {
+        h ^= (uint8_t)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h % args.n_shard;
 }
 static int parse_args(int argc, char **argv)
 {
@@ -361,6 +583,8 @@ static int parse_args(int argc, char **argv)
     const char *thread = NULL;
     const char *qual_thres = NULL;
     const char *code = NULL;
+    const char *cbdis_top = NULL;
+    const char *shards = NULL;
     for (i = 1; i < argc;) {
         const char *a = argv[i++];
         const char **var = 0;
@@ -372,6 +596,10 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-report") == 0) var = &args.report_fname;
         else if (strcmp(a, "-q") == 0) var = &qual_thres;
         else if (strcmp(a, "-x") == 0) var = &code;
+        else if (strcmp(a, "-cbdis") == 0) var = &args.cbdis_fname;
+        else if (strcmp(a, "-cbdis-top") == 0) var = &cbdis_top;
+        else if (strcmp(a, "-shards") == 0) var = &shards;
+        else if (strcmp(a, "-cb-tag") == 0) var = &args.cb_tag;
         else if (strcmp(a, "-order") == 0) {
             args.order = 1;
             continue;
@@ -429,6 +657,7 @@ static int parse_args(int argc, char **argv)
             cb->corr_tag = strdup("CB");
             cb->n = 2;
             cb->r = malloc(cb->n*sizeof(struct bc_reg0));
+            memset(cb->r, 0, cb->n*sizeof(struct bc_reg0));
             struct bc_reg0 *s1 = &cb->r[0];
             struct bc_reg0 *s2 = &cb->r[1];
             s1->rd = s2->rd = 1;
@@ -436,8 +665,8 @@ static int parse_args(int argc, char **argv)
             s1->ed = 10;
             s2->st = 10;
             s2->ed = 20;
-            s1->wl = read_wl_cached(C4_barcodes, 1536, 1);
-            s2->wl = read_wl_cached(C4_barcodes, 1536, 1);
+            load_wl_cached(s1, C4_barcodes, 1536, 1);
+            load_wl_cached(s2, C4_barcodes, 1536, 1);
             
             struct bc_reg *ub = &args.bcs[1];
             memset(ub, 0, sizeof(*ub));
@@ -445,6 +674,7 @@ static int parse_args(int argc, char **argv)
             ub->n = 1;
             ub->raw_tag = strdup("UR");
             ub->r = malloc(sizeof(struct bc_reg0));
+            memset(ub->r, 0, sizeof(struct bc_reg0));
             ub->r->rd = 1;
             ub->r->st = 20;
             ub->r->ed = 30;
@@ -466,6 +696,11 @@ static int parse_args(int argc, char **argv)
     }
     
     if (thread) args.n_thread = str2int((char*)thread);
+    if (cbdis_top) {
+        args.cbdis_top = str2int((char*)cbdis_top);
+        if (args.cbdis_top < 1) error("-cbdis-top should be a positive number.");
+        if (args.cbdis_fname == NULL) error("-cbdis-top requires -cbdis.");
+    }
     if (qual_thres) {
         args.qual_thres = str2int((char*)qual_thres);
         LOG_print("Average quality below %d will be drop.", args.qual_thres);
@@ -480,40 +715,78 @@ static int parse_args(int argc, char **argv)
     }
     else args.fp_report = stderr;
 
+    if (shards) {
+        args.n_shard = str2int((char*)shards);
+        if (args.n_shard < 1) error("-shards should be a positive number.");
+        if (args.out1_fname == NULL) error("-shards requires -1.");
+    }
+    if (args.demux != -1) {
+        if (args.out1_fname == NULL) error("Sample tag %s requires -1.", args.bcs[args.demux].raw_tag);
+        load_samples();
+    }
+    if (args.cbdis_fname || args.n_shard > 1) select_cb_rule();
+    else if (args.cb_tag) error("-cb-tag requires -cbdis or -shards.");
+    args.n_out = args.n_shard * args.n_sample;
+    if (args.n_thread > 1) args.out_pool = hts_tpool_init(args.n_thread);
+    
     if (args.out1_fname) {
-        args.fp_out1 = fopen(args.out1_fname, "w");
-        if (args.fp_out1 == NULL) error("%s: %s.", args.out1_fname, strerror(errno));
-        if (args.out2_fname) {
-            args.fp_out2 = fopen(args.out2_fname,"w");
-            if (args.fp_out2 == NULL) error("%s: %s.", args.out2_fname, strerror(errno));
+        if (is_bam_fname(args.out1_fname)) {
+            if (args.out2_fname) error("-2 is not allowed for BAM output, both reads are written to %s.", args.out1_fname);
+            args.ubam = 1;
+        }
+        args.out1 = open_outs(args.out1_fname);
+        if (args.out2_fname) args.out2 = open_outs(args.out2_fname);
+        if (args.ubam) {
+            for (i = 0; i < args.n_out; ++i) write_ubam_header(args.out1[i].bgzf, argc, argv);
         }
     } else {
-        args.fp_out1 = stdout;
+        args.out1 = malloc(sizeof(struct out_file));
+        memset(args.out1, 0, sizeof(struct out_file));
+        args.out1->fp = stdout;
+        args.out1->fname = strdup("-");
     }
     
     args.fastq = fastq_handler_init(args.r1_fname, args.r2_fname, args.r3_fname, args.r4_fname, args.smart_pair, args.chunk_size);
     if (args.fastq == NULL) error("Failed to init input fastq.");
+    fastq_handler_set_threads(args.fastq, args.n_thread);
+    fastq_handler_set_chunk_bytes(args.fastq, FQ_CHUNK_BYTES);
+
+    args.qs = calloc(args.n_bc+1, sizeof(struct qual_stat));
     
     return 0;
 }
 
 static void memory_release()
 {
-    if (args.fp_out1 != stdout) fclose(args.fp_out1);
-    if (args.fp_out2) fclose(args.fp_out2);
-
     int i;
+    for (i = 0; i < args.n_out; ++i) {
+        close_out(&args.out1[i]);
+        if (args.out2) close_out(&args.out2[i]);
+    }
+    free(args.out1);
+    if (args.out2) free(args.out2);
+    if (args.out_pool) hts_tpool_destroy(args.out_pool);
+
     for (i = 0; i < args.n_bc; ++i) {
         struct bc_reg *r = &args.bcs[i];
         int j = 0;
-        for (j = 0; j < r->n; ++j)
+        for (j = 0; j < r->n; ++j) {
             if (r->r[j].wl) { dict_destroy(r->r[j].wl); r->r[j].wl = NULL; }
+            if (r->r[j].bh) { bc_hash_destroy(r->r[j].bh); r->r[j].bh = NULL; }
+            if (r->r[j].ss) { ss_destroy(r->r[j].ss); r->r[j].ss = NULL; }
+        }
         free(r->r);
         if (r->raw_tag) free(r->raw_tag);
         if (r->corr_tag) free(r->corr_tag);
     }
     
     free(args.bcs);
+    free(args.qs);
+    if (args.samples) {
+        for (i = 0; i < args.n_sample; ++i) free(args.samples[i]);
+        free(args.samples);
+        free(args.sample_reads);
+    }
     free(args.r1->r);
     free(args.r1);
     
@@ -523,6 +796,7 @@ static void memory_release()
     }
     
     fastq_handler_destory(args.fastq);
+    bseq_pool_free_list_destroy();
 }
 static int write_report()
 {
@@ -531,107 +805,412 @@ static int write_report()
     fprintf(args.fp_report, "Fragments pass QC,%"PRIu64"\n", args.reads_pass_qc);
     fprintf(args.fp_report, "Fragments with Exactly Matched Barcodes,%"PRIu64"\n", args.barcode_exactly_matched);
     fprintf(args.fp_report, "Fragments with Failed Barcodes,%"PRIu64"\n", args.filtered_by_barcode);
-    // fprintf(args.fp_report, "Fragments Filtered on Low Quality,%"PRIu64"\n", args.filtered_by_lowqual);
-    // fprintf(args.fp_report, "Q30 bases in Reads,%.1f%%\n", (float)args.q30_bases_reads/(args.bases_reads+1)*100);
+    fprintf(args.fp_report, "Fragments Filtered on Low Quality,%"PRIu64"\n", args.filtered_by_lowqual);
+    if (args.n_cell > 0) fprintf(args.fp_report, "Estimated Number of Cells,%d\n", args.n_cell);
+    int i;
+    for (i = 0; i < args.n_sample && args.samples; ++i)
+        fprintf(args.fp_report, "Fragments of Sample %s,%"PRIu64"\n", args.samples[i], args.sample_reads[i]);
+    for (i = 0; i <= args.n_bc; ++i) {
+        struct qual_stat *st = &args.qs[i];
+        if (st->bases == 0 || st->qual_sum == 0) continue; // FASTA input
+        fprintf(args.fp_report, "Q30 bases in %s,%.1f%%\n", i < args.n_bc ? args.bcs[i].raw_tag : "Reads", (float)st->q30_bases/st->bases*100);
+    }
     
     if (args.fp_report != stderr) fclose(args.fp_report);
     return 0;
 }
+// formatted FASTQ+ records of one chunk, filled by worker and written by write_out()
+struct parse_out {
+    kstring_t *out1; // one buffer per shard
+    kstring_t *out2;
+    struct qual_stat *qs; // segment stats of this chunk, merged by write_out()
+    uint64_t *sample_reads; // NULL if no demultiplexing
+};
+
+static void format_read(kstring_t *out, kstring_t *name, struct bseq_seg *v)
+{
+    kputc(v->q ? '@' : '>', out);
+    kputsn(name->s, name->l, out);
+    kputc('\n', out);
+    kputsn(v->s, v->l, out);
+    kputc('\n', out);
+    if (v->q) {
+        kputsn("+\n", 2, out);
+        kputsn(v->q, v->l, out);
+        kputc('\n', out);
+    }
+}
+// BAM record of unaligned read, written to out as it is in BAM file
+static void format_bam(kstring_t *out, kstring_t *name, struct bseq_seg *v, int flag, kstring_t *aux)
+{
+    int l_name = name->l + 1;
+    if (l_name > 255) error("Read name is too long for BAM, %s.", name->s);
+    uint32_t block = 32 + l_name + ((v->l+1)>>1) + v->l + aux->l;
+    if (ks_resize(out, out->l + block + 4)) error("Failed to allocate memory.");
+    uint8_t *x = (uint8_t*)out->s + out->l;
+    u32_to_le(block, x);
+    i32_to_le(-1, x+4);  // refID
+    i32_to_le(-1, x+8);  // pos
+    x[12] = l_name;
+    x[13] = 0;           // mapq
+    u16_to_le(4680, x+14); // bin of unmapped read
+    u16_to_le(0, x+16);  // no cigar
+    u16_to_le(flag, x+18);
+    i32_to_le(v->l, x+20);
+    i32_to_le(-1, x+24); // next refID
+    i32_to_le(-1, x+28); // next pos
+    i32_to_le(0, x+32);  // tlen
+    x += 36;
+    memcpy(x, name->s, name->l);
+    x[name->l] = '\0';
+    x += l_name;
+    int i;
+    for (i = 0; i + 1 < v->l; i += 2)
+        *x++ = seq_nt16_table[(uint8_t)v->s[i]] << 4 | seq_nt16_table[(uint8_t)v->s[i+1]];
+    if (i < v->l) *x++ = seq_nt16_table[(uint8_t)v->s[i]] << 4;
+    if (v->q) {
+        for (i = 0; i < v->l; ++i) x[i] = v->q[i] - 33;
+    } else memset(x, 0xff, v->l);
+    x += v->l;
+    if (aux->l) memcpy(x, aux->s, aux->l);
+    out->l += block + 4;
+}
+static void aux_put_tag(kstring_t *aux, const char *tag, const char *val, int l)
+{
+    kputsn(tag, 2, aux);
+    kputc('Z', aux);
+    kputsn(val, l, aux);
+    kputc('\0', aux); // terminator is part of Z value
+}
+// Encode FASTQ+ tag "XX:T:VALUE" of length l to BAM aux with its own type, same as sam2bam.
+// A, i and f are encoded here, other types are parsed by sam_parse1 on a stub record. Tags
+// failed to parse are kept as Z.
+static void aux_put_name_tag(kstring_t *aux, const char *p, int l)
+{
+    const char *v = p + 5;
+    char *end = NULL;
+    uint8_t buf[4];
+    int lv = l - 5;
+    char type = p[3];
+    if (type == 'Z') goto put_z;
+    if (type == 'A' && lv == 1) {
+        kputsn(p, 2, aux);
+        kputc('A', aux);
+        kputc(*v, aux);
+        return;
+    }
+    if (type == 'i' && (*v == '-' || isdigit(*v))) {
+        long long x = strtoll(v, &end, 10);
+        if (end == v + lv && x >= INT32_MIN && x <= UINT32_MAX) {
+            // smallest type, same as sam_parse1
+            char t;
+            int n;
+            if (x < 0) {
+                if (x >= INT8_MIN) { t = 'c'; n = 1; buf[0] = (int8_t)x; }
+                else if (x >= INT16_MIN) { t = 's'; n = 2; i16_to_le(x, buf); }
+                else { t = 'i'; n = 4; i32_to_le(x, buf); }
+            } else {
+                if (x <= UINT8_MAX) { t = 'C'; n = 1; buf[0] = x; }
+                else if (x <= UINT16_MAX) { t = 'S'; n = 2; u16_to_le(x, buf); }
+                else { t = 'I'; n = 4; u32_to_le(x, buf); }
+            }
+            kputsn(p, 2, aux);
+            kputc(t, aux);
+            kputsn((char*)buf, n, aux);
+            return;
+        }
+    }
+    if (type == 'f') {
+        double x = strtod(v, &end);
+        if (end == v + lv) {
+            float_to_le(x, buf);
+            kputsn(p, 2, aux);
+            kputc('f', aux);
+            kputsn((char*)buf, 4, aux);
+            return;
+        }
+    }
+    // B, H and others, no reference in the stub so header is not used
+    kstring_t str = {0,0,0};
+    kputs("*\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*\t", &str);
+    kputsn(p, l, &str);
+    bam1_t *b = bam_init1();
+    int ret = sam_parse1(&str, NULL, b);
+    if (ret == 0) {
+        uint8_t *x = bam_get_aux(b);
+        kputsn((char*)x, b->data + b->l_data - x, aux);
+    }
+    bam_destroy1(b);
+    free(str.s);
+    if (ret == 0) return;
+
+  put_z:
+    aux_put_tag(aux, p, v, lv);
+}
+static int is_rule_tag(const char *tag)
+{
+    int i;
+    for (i = 0; i < args.n_bc; ++i) {
+        struct bc_reg *r = &args.bcs[i];
+        if (r->raw_tag && memcmp(r->raw_tag, tag, 2) == 0) return 1;
+        if (r->corr_tag && memcmp(r->corr_tag, tag, 2) == 0) return 1;
+    }
+    return 0;
+}
+// split FASTQ+ name into read name and aux fields, tags redefined by rules are dropped. Tags keep
+// their types
+static void ubam_name_split(kstring_t *n0, kstring_t *name, kstring_t *aux)
+{
+    char *p = strstr(n0->s, "|||");
+    name->l = 0;
+    aux->l = 0;
+    if (p == NULL) {
+        kputsn(n0->s, n0->l, name);
+        return;
+    }
+    kputsn(n0->s, p - n0->s, name);
+    while (p) {
+        p += 3;
+        char *e = strstr(p, "|||");
+        int l = e ? e - p : n0->s + n0->l - p;
+        // TAG:T:VALUE
+        if (l > 5 && p[2] == ':' && p[4] == ':' && !is_rule_tag(p))
+            aux_put_name_tag(aux, p, l);
+        p = e;
+    }
+}
+// append |||TAG:Z:VAL to read name, or update the value if this tag already exists
+static void name_put_tag(kstring_t *name, int has_tags, const char *tag, const char *val, int l)
+{
+    if (has_tags && fname_query_tag(name->s, tag) >= 0) {
+        kstring_t v = {0,0,0};
+        kputsn(val, l, &v);
+        char *new = fname_update_tag(name->s, tag, v.s);
+        free(v.s);
+        if (new == NULL) return; // unchanged or too long
+        name->l = 0;
+        kputs(new, name);
+        free(new);
+        return;
+    }
+    if (name->l + l + 8 > MAX_ID_LENGTH) {
+        if (args.no_warnings == 0)
+            warnings("Failed to update : length of read name is limited to %d", MAX_ID_LENGTH);
+        return;
+    }
+    kputsn("|||", 3, name);
+    kputsn(tag, 2, name);
+    kputsn(":Z:", 3, name);
+    kputsn(val, l, name);
+}
+// counter of this worker thread, merged after all chunks processed
+static __thread struct bc_count *local_count = NULL;
+
+static struct bc_count *worker_count()
+{
+    if (local_count) return local_count;
+    local_count = bc_count_init(args.cbdis_top);
+    pthread_mutex_lock(&args.count_lock);
+    args.counts = realloc(args.counts, (args.n_count+1)*sizeof(struct bc_count*));
+    args.counts[args.n_count++] = local_count;
+    pthread_mutex_unlock(&args.count_lock);
+    return local_count;
+}
+static void write_barcode_counts()
+{
+    if (args.cbdis_fname == NULL) return;
+    FILE *fp = fopen(args.cbdis_fname, "w");
+    if (fp == NULL) error("%s : %s.", args.cbdis_fname, strerror(errno));
+
+    struct bc_count *c = bc_count_init(args.cbdis_top);
+    int i;
+    for (i = 0; i < args.n_count; ++i) {
+        bc_count_merge(c, args.counts[i]);
+        bc_count_destroy(args.counts[i]);
+    }
+    free(args.counts);
+    args.counts = NULL;
+    args.n_count = 0;
+    
+    uint64_t knee_count;
+    args.n_cell = bc_count_write(c, fp, &knee_count);
+    fclose(fp);
+    
+    if (bc_count_skipped(c) && args.no_warnings == 0)
+        warnings("%"PRIu64" barcodes are not counted, only ACGT barcodes no longer than %d bp are counted.", bc_count_skipped(c), BC_COUNT_MAX_LENGTH);
+    if (args.n_cell > 0)
+        LOG_print("Knee of barcode rank at %d barcodes, %"PRIu64" reads.", args.n_cell, knee_count);
+    else
+        LOG_print("No clear knee in barcode rank.");
+    bc_count_destroy(c);
+}
+// return 1 if read should be dropped on quality or N bases
+static int qual_check(struct qual_stat *st, struct bseq_seg *v)
+{
+    if (args.dropN && st->n_bases) return 1;
+    if (args.qual_thres > 0 && v && v->q && v->l > 0 && st->qual_sum < (uint64_t)args.qual_thres*v->l) return 1;
+    return 0;
+}
+// add quality stats of barcodes and reads to qs, set read segments to v1 and v2.
+// Mean quality is checked for reads only, N bases for all segments.
+static int segment_stats(struct bseq *b, struct qual_stat *qs, struct bseq_seg *v1, struct bseq_seg *v2)
+{
+    int drop = 0;
+    struct bseq_seg v;
+    int i, j;
+    for (i = 0; i < args.n_bc; ++i) {
+        struct bc_reg *r = &args.bcs[i];
+        struct qual_stat st = {0,0,0,0};
+        for (j = 0; j < r->n; ++j) {
+            bseq_segment(b, &r->r[j], &v);
+            qual_stat_add(&st, v.s, v.q, v.l);
+        }
+        drop |= qual_check(&st, NULL);
+        qual_stat_merge(&qs[i], &st);
+    }
+    struct qual_stat st = {0,0,0,0};
+    bseq_segment(b, args.r1->r, v1);
+    qual_stat_add(&st, v1->s, v1->q, v1->l);
+    drop |= qual_check(&st, v1);
+    qual_stat_merge(&qs[args.n_bc], &st);
+    v2->l = 0;
+    if (args.r2) {
+        memset(&st, 0, sizeof(st));
+        bseq_segment(b, args.r2->r, v2);
+        qual_stat_add(&st, v2->s, v2->q, v2->l);
+        drop |= qual_check(&st, v2);
+        qual_stat_merge(&qs[args.n_bc], &st);
+    }
+    return drop;
+}
 static void *run_it(void *_p)
 {
     struct bseq_pool *p = (struct bseq_pool*)_p;
+    struct parse_out *o = malloc(sizeof(*o));
+    o->out1 = calloc(args.n_out, sizeof(kstring_t));
+    o->out2 = args.out2 ? calloc(args.n_out, sizeof(kstring_t)) : NULL;
+    o->qs = calloc(args.n_bc+1, sizeof(struct qual_stat));
+    o->sample_reads = args.sample_reads ? calloc(args.n_sample, sizeof(uint64_t)) : NULL;
+
+    // buffers reused by all reads of this chunk
+    kstring_t name = {0,0,0};
+    kstring_t raw = {0,0,0};
+    kstring_t corr = {0,0,0};
+    kstring_t seg = {0,0,0};
+    kstring_t cb = {0,0,0};
+    kstring_t aux = {0,0,0}; // tags of BAM output
+    struct bc_count *count = args.cbdis_fname ? worker_count() : NULL;
     
     int i;
     for (i = 0; i < p->n; ++i) {
         struct bseq *b = &p->s[i];
         int j;
         b->flag = FQ_FLAG_PASS;
+
+        // stats of all segments are counted before any filter
+        struct bseq_seg v1, v2;
+        if (segment_stats(b, o->qs, &v1, &v2)) {
+            b->flag = FQ_FLAG_READ_QUAL;
+            continue;
+        }
+        int has_tags = 0;
+        if (args.ubam) ubam_name_split(&b->n0, &name, &aux);
+        else {
+            name.l = 0;
+            kputsn(b->n0.s, b->n0.l, &name);
+            has_tags = strstr(name.s, "|||") != NULL;
+        }
+        int n_corr = 0; // barcodes checked with white list
+        int all_exact = 1;
+        int sample = 0;
+        
         for (j = 0; j < args.n_bc; ++j) {
             struct bc_reg *r = &args.bcs[j];
-            kstring_t str = {0,0,0};
-            kstring_t corr = {0,0,0};
-            int all_exact = 1;
+            raw.l = 0;
+            corr.l = 0;
             int any_failure = 0; 
             
             int k;
             for (k = 0; k < r->n; ++k) {
                 struct bc_reg0 *r0 = &r->r[k];
-                char *val = bseq_subset_seq(b, r0->rd, r0->st, r0->ed);
+                struct bseq_seg v;
+                bseq_segment(b, r0, &v);
                 if (r->corr_tag) {
                     int ex;
-                    char *val0 = correct_bc(r0->wl, val, &ex);
-                    if (!ex) {
-                        all_exact = 0;
-                    }
-                    if (val0 == NULL) {
+                    int idx = correct_bc(r0, &v, &seg, &corr, &ex);
+                    if (r->demux) sample = idx < 0 ? args.n_sample - 1 : idx; // unmatched to undetermined
+                    if (idx < 0 && r->demux == 0) {
                         any_failure = 1;
                         b->flag = FQ_FLAG_BC_FAILURE;
-                    } else {
-                        kputs(val0, &corr);
+                        break;
                     }
+                    if (!ex) all_exact = 0;
+                    n_corr++;
                 }
-                kputs(val, &str);
-                free(val);
+                kputsn(v.s, v.l, &raw);
             }
-            if (all_exact && b->flag == FQ_FLAG_PASS && !any_failure) {
-                b->flag = FQ_FLAG_BC_EXACTMATCH;
+            if (any_failure) break; // read will be dropped, skip the rest
+
+            // cell barcode is counted, corrected if possible
+            if (j == args.cb_rule) {
+                cb.l = 0;
+                if (corr.l) kputsn(corr.s, corr.l, &cb);
+                else kputsn(raw.s, raw.l, &cb);
             }
 
-            char *name1 = fname_update_tag(b->n0.s, r->raw_tag, str.s);
-            if (corr.l) {
-                char *tmp = name1;
-                //debug_print("%s", tmp);
-                name1 = fname_update_tag(tmp,r->corr_tag, corr.s);
-                free(tmp);
+            if (args.ubam) {
+                aux_put_tag(&aux, r->raw_tag, raw.s, raw.l);
+                if (corr.l) aux_put_tag(&aux, r->corr_tag, corr.s, corr.l);
+                continue;
             }
+            name_put_tag(&name, has_tags, r->raw_tag, raw.s, raw.l);
             // if corrected, create new tag, otherwise keep empty
-            b->n0.l = 0;
-            kputs(name1, &b->n0);
-            
-            free(name1);
-            free(str.s);
-            if (corr.m) free(corr.s);
+            if (corr.l) name_put_tag(&name, has_tags, r->corr_tag, corr.s, corr.l);
         }
+        if (b->flag == FQ_FLAG_BC_FAILURE || b->flag == FQ_FLAG_READ_QUAL) continue;
+        if (n_corr && all_exact) b->flag = FQ_FLAG_BC_EXACTMATCH;
+        if (count && cb.l) bc_count_add(count, cb.s, cb.l);
 
-        char *r1 = NULL;
-        char *q1 = NULL;
-        char *r2 = NULL;
-        char *q2 = NULL;
-        r1 = bseq_subset_seq(b, args.r1->r->rd, args.r1->r->st, args.r1->r->ed);
-        q1 = bseq_subset_qual(b, args.r1->r->rd, args.r1->r->st, args.r1->r->ed);
-
-        if (r1 == NULL) error("Empty read one.");
-        if (args.r2) {
-            r2 = bseq_subset_seq(b, args.r2->r->rd, args.r2->r->st, args.r2->r->ed);
-            q2 = bseq_subset_qual(b, args.r2->r->rd, args.r2->r->st, args.r2->r->ed);
-        }
+        int shard = sample*args.n_shard + (args.n_shard > 1 ? shard_of(cb.s, cb.l) : 0);
+        kstring_t *out1 = &o->out1[shard];
+        kstring_t *out2 = o->out2 ? &o->out2[shard] : out1;
+        if (o->sample_reads) o->sample_reads[sample]++;
         
-        // update reads
-        b->s0.l = 0;
-        b->q0.l = 0;
-        kputs(r1, &b->s0);
-        if (q1) kputs(q1, &b->q0);
-
-        b->s1.l = 0;
-        b->q1.l = 0;
-        if (r2) kputs(r2, &b->s1);
-        if (q2) kputs(q2, &b->q1);
-
-        if (r1) free(r1);
-        if (q1) free(q1);
-        if (r2) free(r2);
-        if (q2) free(q2);
+        // trimmed reads are written from offsets of raw reads
+        if (args.ubam) {
+            if (args.r2 && v2.l > 0) {
+                format_bam(out1, &name, &v1, BAM_FPAIRED|BAM_FUNMAP|BAM_FMUNMAP|BAM_FREAD1, &aux);
+                format_bam(out1, &name, &v2, BAM_FPAIRED|BAM_FUNMAP|BAM_FMUNMAP|BAM_FREAD2, &aux);
+            }
+            else format_bam(out1, &name, &v1, BAM_FUNMAP, &aux);
+            continue;
+        }
+        format_read(out1, &name, &v1);
+        if (args.r2 && v2.l > 0) format_read(out2, &name, &v2);
     }
+    if (name.m) free(name.s);
+    if (raw.m) free(raw.s);
+    if (corr.m) free(corr.s);
+    if (seg.m) free(seg.s);
+    if (cb.m) free(cb.s);
+    if (aux.m) free(aux.s);
+    p->opts = o;
     return p;
 }
 
+static void write_buf(kstring_t *buf, struct out_file *f)
+{
+    if (buf->l == 0) return;
+    if (f->bgzf) {
+        if (bgzf_write(f->bgzf, buf->s, buf->l) != buf->l) error("Failed to write %s.", f->fname);
+    }
+    else if (fwrite(buf->s, 1, buf->l, f->fp) != buf->l) error("Failed to write %s : %s.", f->fname, strerror(errno));
+}
 static void write_out(void *_p)
 {
     struct bseq_pool *p = (struct bseq_pool*)_p;
+    struct parse_out *o = (struct parse_out*)p->opts;
     
-    FILE *fp1 = args.fp_out1 == NULL ? stdout : args.fp_out1;
-    FILE *fp2 = args.fp_out2 == NULL ? fp1 : args.fp_out2;
-
     int i;
     for (i = 0; i < p->n; ++i) {
         struct bseq *b = &p->s[i];
@@ -653,67 +1232,173 @@ static void write_out(void *_p)
         }
 
         args.reads_pass_qc++;
-        fprintf(fp1, "%c%s\n%s\n", b->q0.l ? '@' : '>', b->n0.s, b->s0.s);
-        if (b->q0.l) fprintf(fp1, "+\n%s\n", b->q0.s);
-        if (b->s1.l > 0) {
-            fprintf(fp2, "%c%s\n%s\n", b->q1.l ? '@' : '>', b->n0.s, b->s1.s);
-            if (b->q1.l) fprintf(fp2, "+\n%s\n", b->q1.s);
+    }
+    for (i = 0; i <= args.n_bc; ++i) qual_stat_merge(&args.qs[i], &o->qs[i]);
+    if (o->sample_reads) {
+        for (i = 0; i < args.n_sample; ++i) args.sample_reads[i] += o->sample_reads[i];
+        free(o->sample_reads);
+    }
+    for (i = 0; i < args.n_out; ++i) {
+        write_buf(&o->out1[i], &args.out1[i]);
+        if (o->out1[i].m) free(o->out1[i].s);
+        if (o->out2) {
+            write_buf(&o->out2[i], &args.out2[i]);
+            if (o->out2[i].m) free(o->out2[i].s);
         }
     }
-    bseq_pool_destroy(p);
-    fflush(fp1);
-    if (fp2 != fp1) fflush(fp2);
+    free(o->out1);
+    if (o->out2) free(o->out2);
+    free(o->qs);
+    free(o);
+    p->opts = NULL;
+    bseq_pool_recycle(p);
 }
 
-void fastq_parse_order()
+// Parse runs as a pipeline: main thread reads chunks and dispatches them to workers, a writer
+// thread writes finished chunks. Queues are bounded, so a slow stage blocks the stages before it.
+// With -order the writer takes results of the thread pool in input order, otherwise workers hand
+// over chunks in finishing order.
+static struct pipeline {
+    hts_tpool *pool;
+    hts_tpool_process *q;
+    int qsize;
+    // finished chunks, unordered mode only
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct bseq_pool **done;
+    int n, head;
+    int closed;
+    // stats
+    uint64_t n_chunk;
+    uint64_t in_occ; // input queue length summed at each dispatch
+    uint64_t out_occ; // finished chunks summed at each write
+    double read_busy, read_block;
+    double work_busy, work_block; // summed over workers
+    double write_busy, write_idle;
+} pl;
+
+static void *run_chunk(void *_p)
 {
-    hts_tpool *p = hts_tpool_init(args.n_thread);
-    hts_tpool_process *q = hts_tpool_process_init(p, args.n_thread*2, 0);
-    hts_tpool_result *r;
-    
-    for (;;) {
-        struct bseq_pool *pool = fastq_read(args.fastq, NULL);
-        
-        if (pool == NULL) break;
-        
-        int block;
-        do {
-            block = hts_tpool_dispatch2(p, q, run_it, pool, 1);
-            if ((r = hts_tpool_next_result(q))) {
-                struct bseq_pool *pool = (struct bseq_pool*)hts_tpool_result_data(r);
-                write_out(pool);
-                hts_tpool_delete_result(r, 0);
-            }
-        }
-        while (block == -1);
-    }
-    
-    hts_tpool_process_flush(q);
-    
-    while ((r = hts_tpool_next_result(q))) {
-        struct bseq_pool *pool = (struct bseq_pool*)hts_tpool_result_data(r);
-        write_out(pool);
+    if (_p == NULL) return NULL; // end of input
+    double t = realtime();
+    void *p = run_it(_p);
+    t = realtime() - t;
+    pthread_mutex_lock(&pl.lock);
+    pl.work_busy += t;
+    pthread_mutex_unlock(&pl.lock);
+    return p;
+}
+static void *run_chunk_unorder(void *_p)
+{
+    struct bseq_pool *p = run_chunk(_p);
+    double t = realtime();
+    pthread_mutex_lock(&pl.lock);
+    while (pl.n == pl.qsize) pthread_cond_wait(&pl.not_full, &pl.lock);
+    pl.done[(pl.head + pl.n) % pl.qsize] = p;
+    pl.n++;
+    pl.work_block += realtime() - t;
+    pthread_cond_signal(&pl.not_empty);
+    pthread_mutex_unlock(&pl.lock);
+    return NULL;
+}
+// return NULL at the end
+static struct bseq_pool *next_chunk()
+{
+    if (args.order) {
+        hts_tpool_result *r = hts_tpool_next_result_wait(pl.q);
+        if (r == NULL) error("Thread pool is shut down unexpectedly.");
+        pl.out_occ += hts_tpool_process_len(pl.q);
+        struct bseq_pool *p = (struct bseq_pool*)hts_tpool_result_data(r);
         hts_tpool_delete_result(r, 0);
+        return p;
     }
-    hts_tpool_process_destroy(q);
-    hts_tpool_destroy(p);
-}
 
-void fastq_parse_unorder()
+    struct bseq_pool *p = NULL;
+    pthread_mutex_lock(&pl.lock);
+    while (pl.n == 0 && pl.closed == 0) pthread_cond_wait(&pl.not_empty, &pl.lock);
+    if (pl.n > 0) {
+        pl.out_occ += pl.n - 1;
+        p = pl.done[pl.head];
+        pl.head = (pl.head + 1) % pl.qsize;
+        pl.n--;
+        pthread_cond_signal(&pl.not_full);
+    }
+    pthread_mutex_unlock(&pl.lock);
+    return p;
+}
+static void *write_thread(void *_d)
 {
-    struct bseq_pool *b;
-
-#pragma omp parallel private(b) num_threads(args.n_thread)
     for (;;) {
-        
-#pragma omp critical (read)
-        b = fastq_read(args.fastq, NULL);
+        double t = realtime();
+        struct bseq_pool *p = next_chunk();
+        pl.write_idle += realtime() - t;
+        if (p == NULL) break;
+        t = realtime();
+        write_out(p);
+        pl.write_busy += realtime() - t;
+    }
+    return NULL;
+}
+static void pipeline_report(double t_pipe)
+{
+    double n = pl.n_chunk ? (double)pl.n_chunk : 1;
+    LOG_print("Pipeline: %"PRIu64" chunks; reader busy %.2f s, blocked %.2f s; %d workers busy %.2f s (%.1f%%), blocked %.2f s; writer busy %.2f s, idle %.2f s.",
+              pl.n_chunk, pl.read_busy, pl.read_block, args.n_thread, pl.work_busy,
+              t_pipe > 0 ? pl.work_busy/(t_pipe*args.n_thread)*100 : 0, pl.work_block, pl.write_busy, pl.write_idle);
+    LOG_print("Queue occupancy: input %.1f/%d, output %.1f/%d on average.",
+              pl.in_occ/n, pl.qsize, pl.out_occ/n, pl.qsize);
+}
+static void fastq_parse_pipeline()
+{
+    memset(&pl, 0, sizeof(pl));
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.not_empty, NULL);
+    pthread_cond_init(&pl.not_full, NULL);
+    pl.qsize = args.n_thread*2;
+    pl.done = malloc(pl.qsize*sizeof(struct bseq_pool*));
+    pl.pool = hts_tpool_init(args.n_thread);
+    pl.q = hts_tpool_process_init(pl.pool, pl.qsize, args.order ? 0 : 1);
+    void *(*func)(void*) = args.order ? run_chunk : run_chunk_unorder;
+    
+    double t_pipe = realtime();
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, write_thread, NULL)) error("Failed to create writer thread.");
+    
+    for (;;) {
+        double t = realtime();
+        struct bseq_pool *b = fastq_read(args.fastq, NULL);
+        pl.read_busy += realtime() - t;
         if (b == NULL) break;
-        b = run_it(b);
         
-#pragma omp critical (write)
-        write_out(b);            
+        pl.n_chunk++;
+        pl.in_occ += hts_tpool_process_sz(pl.q) - (args.order ? hts_tpool_process_len(pl.q) : 0);
+        t = realtime();
+        if (hts_tpool_dispatch(pl.pool, pl.q, func, b) == -1) error("Failed to dispatch chunk.");
+        pl.read_block += realtime() - t;
     }
+
+    if (args.order) {
+        // empty job closes ordered output
+        if (hts_tpool_dispatch(pl.pool, pl.q, run_chunk, NULL) == -1) error("Failed to dispatch chunk.");
+    } else {
+        hts_tpool_process_flush(pl.q);
+        pthread_mutex_lock(&pl.lock);
+        pl.closed = 1;
+        pthread_cond_signal(&pl.not_empty);
+        pthread_mutex_unlock(&pl.lock);
+    }
+    pthread_join(writer, NULL);
+    t_pipe = realtime() - t_pipe;
+    
+    hts_tpool_process_destroy(pl.q);
+    hts_tpool_destroy(pl.pool);
+    free(pl.done);
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.not_empty);
+    pthread_cond_destroy(&pl.not_full);
+
+    pipeline_report(t_pipe);
 }
 
 extern int fastq_parse2_usage();
@@ -724,11 +1409,9 @@ int fastq_parse2(int argc, char **argv)
     
     if (parse_args(argc, argv)) return fastq_parse2_usage();
 
-    if (args.order)
-        fastq_parse_order();
-    else
-        fastq_parse_unorder();
+    fastq_parse_pipeline();
     
+    write_barcode_counts();
     write_report();
     memory_release();
 
@@ -468,6 +468,7 @@ static void config_init(const char *fn)
             free(br->white_list[j]);
         }
         free(br->white_list);
+        ss_build(br->wl, br->dist);
     }
     kson_destroy(json);
 }
@@ -1,4 +1,5 @@
 #include "utils.h"
+#include "fastq.h"
 #include "htslib/khash.h"
 #include "htslib/kstring.h"
 #include "dict.h"
@@ -6,15 +7,20 @@
 #include "read_tags.h"
 #include "htslib/thread_pool.h"
 #include "htslib/bgzf.h"
+#include "htslib/hts.h"
+#include "htslib/hfile.h"
 #include <zlib.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #ifdef _OPENMP
 #include <omp.h>
 #endif
 
 #define MIN_MEM_PER_THREAD  100000 // 100K
+#define MERGE_READ_AHEAD    0x100000 // read buffer of each temp file in merge
+#define BUCKET_MAX          (INT_MAX - 0x1000000) // bytes of a bucket grouped in memory
 
 static struct args {
     const char *input_fname;
@@ -33,6 +39,13 @@ static struct args {
     struct dict *bcodes;
     int read_counts;
     int nondup;
+    const char *tmp_mode; // bgzf_open mode of temp files
+    hts_tpool *pool; // compress temp files and output
+    long mem_budget; // memory of all threads, 0 for -m only
+    int fan_in; // runs merged at once
+    long tmp_bytes;
+    long peak_tmp_bytes;
+    int n_bucket; // group records in hash buckets instead of sorting, 0 for sort
 } args = {
     .input_fname = NULL,
     .list_fname = NULL,
@@ -49,12 +62,35 @@ static struct args {
     .bcodes = NULL,
     .read_counts = 0,
     .nondup = 0,
+    .tmp_mode = "w1",
+    .pool = NULL,
+    .mem_budget = 0,
+    .fan_in = 0,
+    .tmp_bytes = 0,
+    .peak_tmp_bytes = 0,
+    .n_bucket = 0,
 };
 
 static void memory_release()
 {
     dict_destroy(args.tags);
     if (args.check_list) dict_destroy(args.bcodes);
+    if (args.pool) hts_tpool_destroy(args.pool);
+}
+static long file_size(const char *fn)
+{
+    struct stat st;
+    if (stat(fn, &st)) error("%s : %s.", fn, strerror(errno));
+    return st.st_size;
+}
+// temp files on disk, negative size for removed file
+static void tmp_bytes_add(long size)
+{
+#pragma omp critical (tmp_bytes)
+    {
+        args.tmp_bytes += size;
+        if (args.tmp_bytes > args.peak_tmp_bytes) args.peak_tmp_bytes = args.tmp_bytes;
+    }
 }
 static int parse_args(int argc, char **argv)
 {
@@ -65,6 +101,9 @@ static int parse_args(int argc, char **argv)
     // const char *file_thread = NULL;
     const char *tags = NULL;
     const char *memory = NULL;
+    const char *tmp_fmt = NULL;
+    const char *mem_budget = NULL;
+    const char *bucket = NULL;
     for (i = 1; i < argc; ) {
         const char *a = argv[i++];
         const char **var = 0;
@@ -76,7 +115,10 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-o") == 0) var = &args.output_fname;
         else if (strcmp(a, "-prefix") == 0) var = &args.prefix;
         else if (strcmp(a, "-m") == 0) var = &memory;
+        else if (strcmp(a, "-mem") == 0) var = &mem_budget;
         else if (strcmp(a, "-report") == 0) var = &args.report_fname;
+        else if (strcmp(a, "-tmp-fmt") == 0) var = &tmp_fmt;
+        else if (strcmp(a, "-bucket") == 0) var = &bucket;
         else if (strcmp(a, "-dropN") == 0) {
             args.dropN = 1;
             continue;
@@ -123,8 +165,26 @@ static int parse_args(int argc, char **argv)
     // if (file_thread) args.n_thread = str2int(file_thread);
     if (args.n_thread < 1) args.n_thread = 1;
     if (memory) args.mem_per_thread = human2int(memory);
+    if (mem_budget) {
+        args.mem_budget = human2long(mem_budget);
+        // a block in memory takes about twice its size with sort keys and buffer growth
+        long per_thread = args.mem_budget / args.n_thread / 2;
+        args.mem_per_thread = per_thread > INT_MAX ? INT_MAX : per_thread;
+    }
 
     if (args.mem_per_thread < MIN_MEM_PER_THREAD) args.mem_per_thread = MIN_MEM_PER_THREAD;
+
+    if (tmp_fmt) {
+        if (strcmp(tmp_fmt, "raw") == 0) args.tmp_mode = "wu";
+        else if (strcmp(tmp_fmt, "fast") == 0) args.tmp_mode = "w1";
+        else if (strcmp(tmp_fmt, "bgzf") == 0) args.tmp_mode = "w";
+        else error("Unknown temp file format %s, should be raw, fast or bgzf.", tmp_fmt);
+    }
+    if (bucket) {
+        args.n_bucket = str2int(bucket);
+        if (args.n_bucket < 1) error("-bucket should be a positive number.");
+    }
+    if (args.n_thread > 1) args.pool = hts_tpool_init(args.n_thread);
     
     if (args.list_fname) {
         args.bcodes = dict_init();
@@ -144,10 +204,20 @@ struct record_offset {
     uint64_t *offsets;
 };
 
+// record sorted by packed tag values
+struct record_key {
+    uint64_t key;
+    uint64_t offset;
+};
+
 struct read_block {
     struct dict *dict;
     int n, m;
     struct record_offset *idx;
+    // sorted by packed keys instead of dict if all tag values are DNA
+    struct record_key *keys; // n_record keys, NULL if sorted by names
+    int n_group;
+    char **group_name;
     int max;
     uint8_t *data;
     int n_record; // number of record in this block
@@ -157,6 +227,8 @@ struct fastq_idx {
     int n;
     char **name; // block name
     int *length;
+    int *records;
+    char **vals; // tab separated tag values of each block, only kept for the sorted output
 };
 
 void fastq_idx_destroy(struct fastq_idx *i)
@@ -166,18 +238,27 @@ void fastq_idx_destroy(struct fastq_idx *i)
     free(i->name);
     //free(i->offset);
     free(i->length);
+    free(i->records);
+    if (i->vals) {
+        for (k = 0; k < i->n; ++k) free(i->vals[k]);
+        free(i->vals);
+    }
     free(i);
 }
-// this struct cache fastq temp files, a array of size max_file_open inited in the beginning
+// this struct cache fastq temp files, one node for each sorted run
 struct fastq_node {
     // struct fastq_node *next;
     // struct fastq_node *before;
     char *fn; // point to file name, update by each round
+    long size; // bytes of file
     BGZF *fp; // file handler of fn
     struct fastq_idx *idx; // read block and offset in the file
     int i; // 
-    char *name; // point to idx::name[i]
-    int n, m; // buf size
+    char *name; // point to idx::name[i], NULL if all blocks are written
+    uint64_t key; // first 8 bytes of name, compared before strcmp
+    // blocks are read ahead into buf, current block is buf[off, off+n)
+    int off, n;
+    int l_buf, m; // bytes read and buf size
     char *buf;
 };
 
@@ -196,53 +277,61 @@ struct fastq_stream {
     struct fastq_node *n;
 };
 
-struct read_block *read_block_file(BGZF *fp, int max, int paired)
+// Append next line of fp to str, including the newline. Lines are found by memchr in the
+// decompressed BGZF block and copied in bulk. Return bytes appended, 0 at end of file.
+// Like bgzf_getline(), a used up block is reset, as reading plain gzip does not do this.
+static int bgzf_append_line(BGZF *fp, kstring_t *str)
+{
+    size_t l0 = str->l;
+    for (;;) {
+        if (fp->block_offset >= fp->block_length) {
+            if (bgzf_read_block(fp) != 0) error("Failed to read input.");
+            if (fp->block_length == 0) break; // end of file
+        }
+        const char *buf = (const char*)fp->uncompressed_block + fp->block_offset;
+        int l = fp->block_length - fp->block_offset;
+        const char *e = memchr(buf, '\n', l);
+        if (e) l = e - buf + 1;
+        kputsn(buf, l, str);
+        fp->block_offset += l;
+        if (fp->block_offset >= fp->block_length) {
+            // see bgzf_htell(), block address is set by the reader thread for multithreaded input
+            if (fp->mt == NULL) fp->block_address = htell(fp->fp);
+            fp->block_offset = fp->block_length = 0;
+        }
+        if (e) break;
+    }
+    fp->uncompressed_address += str->l - l0;
+    return str->l - l0;
+}
+// Read records until max bytes. *eof is set if stopped at end of file.
+struct read_block *read_block_file(BGZF *fp, int max, int paired, int *eof)
 {
     struct read_block *r = malloc(sizeof(*r));
     memset(r, 0, sizeof(*r));
-    int fasta;
 
     kstring_t str = {0,0,0};
     
-    // int record = 0; // record numbers
     int last_record = 0; // offset of last record
     for (;;) {
-        char c = bgzf_getc(fp);
-        if (c == EOF) break;
-        if (c == '@') fasta= 0;
-        else if (c == '>') fasta = 1;
+        if (bgzf_append_line(fp, &str) == 0) {
+            *eof = 1;
+            break;
+        }
+        int fasta;
+        if (str.s[last_record] == '@') fasta = 0;
+        else if (str.s[last_record] == '>') fasta = 1;
         else error("Unknown input format.");
 
-        kputc(c, &str);
-        for (c = bgzf_getc(fp); c && c != '\n'; c = bgzf_getc(fp)) kputc(c, &str); // read name;
-        if (c == EOF) error("Truncated file?");
-    
-        kputc(c, &str); // push \n to buf
-
-        for (c = bgzf_getc(fp); c && c != '\n'; c = bgzf_getc(fp)) kputc(c, &str); //
-        kputc(c, &str); // push \n to buf
-    
-        if (fasta == 0) {
-            c = bgzf_getc(fp);
-            if (c != '+') error("Unknown format? %c",c);
-            kputc(c, &str); // push + to buf
-            for (c = bgzf_getc(fp); c && c!= '\n'; c = bgzf_getc(fp)) kputc(c, &str); // qual name
-            kputc(c, &str); // push \n to buf
-            for (c = bgzf_getc(fp); c && c != '\n'; c = bgzf_getc(fp)) kputc(c, &str); //
-            kputc(c, &str);
-            
-            if (paired) {
-                // read four more lines
-                for (c = bgzf_getc(fp); c && c != '\n'; c = bgzf_getc(fp)) kputc(c, &str); //
-                kputc(c, &str); 
-                for (c = bgzf_getc(fp); c && c != '\n'; c = bgzf_getc(fp)) kputc(c, &str); //
-                kputc(c, &str);
-                for (c = bgzf_getc(fp); c && c != '\n'; c = bgzf_getc(fp)) kputc(c, &str); //
-                kputc(c, &str);
-                for (c = bgzf_getc(fp); c && c != '\n'; c = bgzf_getc(fp)) kputc(c, &str); //
-                kputc(c, &str);
-            }        
+        // name and sequence, then + and quality, then four more lines of mate
+        int n_line = fasta ? 2 : paired ? 8 : 4;
+        int i;
+        for (i = 1; i < n_line; ++i) {
+            int start = str.l;
+            if (bgzf_append_line(fp, &str) == 0) error("Truncated file?");
+            if (i == 2 && str.s[start] != '+') error("Unknown format? %c", str.s[start]);
         }
+        if (str.s[str.l-1] != '\n') kputc('\n', &str); // last line of file
 
         if (args.check_list) {
             char *val = fname_pick_tag(str.s+last_record, dict_name(args.tags,0));
@@ -255,7 +344,7 @@ struct read_block *read_block_file(BGZF *fp, int max, int paired)
         
         last_record = str.l;
         r->n_record++;
-        if (str.s[str.l-1] == '\n') str.s[str.l-1] = '\0';
+        str.s[str.l-1] = '\0';
         if (str.l >= max) break;
     }
     if (str.l == 0) {
@@ -323,8 +412,160 @@ static int name_cmp(const void *a, const void *b)
 /*     return str.s; */
 /* } */
 
+// Value of tag in record name p, including the type prefix, such as Z:ACGT. Return length of
+// value, or -1 if tag is not found.
+static int record_tag_value(const char *p, const char *tag, const char **val)
+{
+    int i, l;
+    for (i = 0; p[i] != '\n' && p[i] != '\0' && !isspace(p[i]); ++i) {
+        if (p[i] == '|' && p[i+1] == '|' && p[i+2] == '|' && p[i+3] == tag[0] && p[i+4] == tag[1] && p[i+5] == ':') {
+            *val = p + i + 6;
+            for (l = 0; (*val)[l] != '|' && (*val)[l] != '\n' && (*val)[l] != '\0' && !isspace((*val)[l]); ++l);
+            return l;
+        }
+    }
+    return -1;
+}
+// tab separated tag values of the first record in buffer p
+static char *record_tag_values(const char *p)
+{
+    kstring_t str = {0,0,0};
+    int i;
+    for (i = 0; i < dict_size(args.tags); ++i) {
+        const char *v = NULL;
+        int l = record_tag_value(p, dict_name(args.tags, i), &v);
+        if (i) kputc('\t', &str);
+        if (l < 0) {
+            kputc('.', &str);
+            continue;
+        }
+        if (l >= 2 && v[1] == ':') {
+            v += 2;
+            l -= 2;
+        }
+        kputsn(v, l, &str);
+    }
+    return str.s;
+}
+// Pack tag values of the record name p into key, 2 bits per base. Values of each tag should be
+// ACGT strings of the same length and type, set by the first record, so the order of keys is
+// the same as the order of name strings. Return 1 if any value cannot be packed.
+static int record_key(const char *p, struct dict *tags, int *lens, char *types, uint64_t *key)
+{
+    static const int8_t nt4[256] = {
+        ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4,
+    };
+    int n_tag = dict_size(tags);
+    int i, t;
+    uint64_t k = 0;
+    int bases = 0;
+    for (t = 0; t < n_tag; ++t) {
+        const char *v = NULL;
+        int l = record_tag_value(p, dict_name(tags, t), &v);
+        if (l < 0) return 1;
+        char type = 0;
+        if (l >= 2 && v[1] == ':') {
+            type = v[0];
+            v += 2;
+            l -= 2;
+        }
+        for (i = 0; i < l; ++i) {
+            int c = nt4[(uint8_t)v[i]];
+            if (c == 0) return 1;
+            k = k << 2 | (c - 1);
+        }
+        if (lens[t] == -1) {
+            lens[t] = l;
+            types[t] = type;
+        }
+        else if (lens[t] != l || types[t] != type) return 1;
+        bases += l;
+        if (bases > 32) return 1;
+    }
+    *key = k;
+    return 0;
+}
+// LSD radix sort on 8 bits per pass, stable, so records of a group keep input order
+static void radix_sort_keys(struct record_key *a, int n, int bits)
+{
+    if (n == 0) return;
+    struct record_key *buf = malloc(n*sizeof(*buf));
+    struct record_key *src = a, *dst = buf;
+    int shift;
+    for (shift = 0; shift < bits; shift += 8) {
+        int count[257] = {0};
+        int i;
+        for (i = 0; i < n; ++i) count[((src[i].key >> shift) & 0xff)+1]++;
+        if (count[((src[0].key >> shift) & 0xff)+1] == n) continue; // all the same on this digit
+        for (i = 1; i < 257; ++i) count[i] += count[i-1];
+        for (i = 0; i < n; ++i) dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
+        struct record_key *t = src; src = dst; dst = t;
+    }
+    if (src != a) memcpy(a, src, n*sizeof(*a));
+    free(buf);
+}
+// fast path of read_block_sort_by_name, return 1 if any tag value is not DNA
+static int read_block_sort_by_key(struct read_block *r, struct dict *tag)
+{
+    int n_tag = dict_size(tag);
+    int *lens = malloc(n_tag*sizeof(int));
+    char *types = malloc(n_tag);
+    int i;
+    for (i = 0; i < n_tag; ++i) lens[i] = -1;
+
+    r->keys = malloc(r->n_record*sizeof(struct record_key));
+    int n = 0;
+    for (i = 0; i < r->max; ) {
+        if (n == r->n_record || record_key((const char*)r->data+i, tag, lens, types, &r->keys[n].key)) break;
+        r->keys[n++].offset = i;
+        for (; r->data[i] != '\0'; ++i) {}
+        ++i; // skip \0
+    }
+    if (i < r->max || n != r->n_record) {
+        free(lens);
+        free(types);
+        free(r->keys);
+        r->keys = NULL;
+        return 1;
+    }
+    int bases = 0;
+    for (i = 0; i < n_tag; ++i) bases += lens[i];
+    radix_sort_keys(r->keys, n, bases*2);
+
+    // group names are decoded from keys, in the same format of fname_tagvalstr()
+    kstring_t str = {0,0,0};
+    int m = 0;
+    for (i = 0; i < n; ++i) {
+        if (i > 0 && r->keys[i].key == r->keys[i-1].key) continue;
+        if (r->n_group == m) {
+            m = m == 0 ? 1024 : m*2;
+            r->group_name = realloc(r->group_name, m*sizeof(char*));
+        }
+        str.l = 0;
+        int t, shift = bases*2;
+        for (t = 0; t < n_tag; ++t) {
+            if (t > 0) kputc('_', &str);
+            if (types[t]) {
+                kputc(types[t], &str);
+                kputc('_', &str);
+            }
+            int j;
+            for (j = 0; j < lens[t]; ++j) {
+                shift -= 2;
+                kputc("ACGT"[r->keys[i].key >> shift & 3], &str);
+            }
+        }
+        r->group_name[r->n_group++] = strdup(str.s);
+    }
+    if (str.m) free(str.s);
+    free(lens);
+    free(types);
+    return 0;
+}
 void read_block_sort_by_name(struct read_block *r, struct dict *tag)
 {
+    if (read_block_sort_by_key(r, tag) == 0) return;
+
     r->dict = dict_init();
     
     int i = 0;
@@ -372,104 +613,156 @@ void read_block_destroy(struct read_block *r)
         if (r->idx[i].m) free(r->idx[i].offsets);
     free(r->idx);
     dict_destroy(r->dict);
+    if (r->keys) free(r->keys);
+    for (i = 0; i < r->n_group; ++i) free(r->group_name[i]);
+    if (r->group_name) free(r->group_name);
     free(r->data);
     free(r);
 }
 
-struct fastq_idx *write_block_with_idx(const char *fn, struct read_block *r)
+static int write_record(BGZF *fp, struct read_block *r, uint64_t offset, kstring_t *buf)
 {
-    if (dict_size(r->dict) == 0) return NULL;
+    buf->l = 0;
+    kputs((char*)(r->data+offset), buf);
+    kputc('\n', buf);
+    int ret = bgzf_write(fp, buf->s, buf->l);
+    assert(ret == buf->l);
+    return buf->l;
+}
+// write groups of block to fn, tag values of each group are kept if keep_vals is set
+struct fastq_idx *write_block_with_idx(const char *fn, struct read_block *r, const char *mode, int keep_vals)
+{
+    int n_group = r->keys ? r->n_group : dict_size(r->dict);
+    if (n_group == 0) return NULL;
     LOG_print("Write %d records to %s.", r->n_record, fn);
-    BGZF *fp = bgzf_open(fn, "w");   
+    BGZF *fp = bgzf_open(fn, mode);
     if (fp == NULL) error("%s : %s.", fn, strerror(errno));
-    // bgzf_mt(fp, args.n_thread, 256);
+    // compressed by the shared pool, so the worker can read next block
+    if (args.pool) bgzf_thread_pool(fp, args.pool, 64);
     struct fastq_idx *idx = malloc(sizeof(*idx));
     memset(idx, 0, sizeof(*idx));
-    idx->n = dict_size(r->dict);
+    idx->n = n_group;
     idx->name = malloc(idx->n*sizeof(char*));
     idx->length = malloc(idx->n*sizeof(int));
+    idx->records = malloc(idx->n*sizeof(int));
+    if (keep_vals) idx->vals = malloc(idx->n*sizeof(char*));
     
     kstring_t buf ={0,0,0};
     int i;
-    for (i = 0; i < idx->n; ++i) {
-        idx->length[i] = 0;
-        char *name = dict_name(r->dict, i);
-        int old_idx = dict_query(r->dict, name);
-        struct record_offset *off = &r->idx[old_idx];
-        int j;        
-        for (j = 0; j < off->n; ++j) {
-            buf.l = 0;
-            kputs((char*)(r->data+off->offsets[j]),&buf);
-            kputc('\n', &buf);
-            int ret = bgzf_write(fp, buf.s, buf.l);
-            assert(ret == buf.l);
-            idx->length[i] += buf.l;
-        }
-        idx->name[i] = strdup(name);
+    if (r->keys) {
+        int j = 0;
+        for (i = 0; i < idx->n; ++i) {
+            idx->length[i] = 0;
+            uint64_t key = r->keys[j].key;
+            int j0 = j;
+            if (keep_vals) idx->vals[i] = record_tag_values((char*)r->data + r->keys[j].offset);
+            for (; j < r->n_record && r->keys[j].key == key; ++j)
+                idx->length[i] += write_record(fp, r, r->keys[j].offset, &buf);
+            idx->records[i] = j - j0;
+            idx->name[i] = r->group_name[i];
+            r->group_name[i] = NULL;
+        }
+    }
+    else {
+        for (i = 0; i < idx->n; ++i) {
+            idx->length[i] = 0;
+            char *name = dict_name(r->dict, i);
+            int old_idx = dict_query(r->dict, name);
+            struct record_offset *off = &r->idx[old_idx];
+            int j;        
+            if (keep_vals) idx->vals[i] = record_tag_values((char*)r->data + off->offsets[0]);
+            for (j = 0; j < off->n; ++j)
+                idx->length[i] += write_record(fp, r, off->offsets[j], &buf);
+            idx->records[i] = off->n;
+            idx->name[i] = strdup(name);
+        }
     }
     if (buf.m) free(buf.s);
     bgzf_close(fp);
     return idx;
 }
-static int merge_cmp(const void *a, const void *b)
+// first 8 bytes of name packed in big endian, so integer order is the same as strcmp order
+static inline uint64_t name_key(const char *name)
 {
-    const struct fastq_node *ia = *(const struct fastq_node **)a;
-    const struct fastq_node *ib = *(const struct fastq_node **)b;
-
-    if (ia->name == NULL) return 1;
-    if (ib->name == NULL) return -1;
-
-    return strcmp(ia->name, ib->name);
+    uint64_t k = 0;
+    int i;
+    for (i = 0; i < 8 && name[i]; ++i) k |= (uint64_t)(uint8_t)name[i] << (56 - i*8);
+    return k;
 }
-int fastq_merge_core(struct fastq_node **node, int n_node, BGZF *fp)
+// exhausted node is the largest, equal names are ordered by node index to keep input order
+static inline int node_less(struct fastq_node **node, int a, int b)
 {
-    // int n = n_node;
-    if (node[0]->name == NULL) return 0;
-    char *name = strdup(node[0]->name);
-    int length = 0;
-    int i;
-    for (i = 0; i < n_node; ++i) {
-        struct fastq_node *d = node[i];
-
-        if (d->name == NULL) break;
-        
-        if (strcmp(name, d->name) == 0) {
-            d->buf[d->n] = '\0';
-            int ret = bgzf_write(fp, d->buf, d->n);
-            if (ret != d->n) error("Failed to write. %s", d->fn);
-            length+=d->n;
-            // cache next record
-            d->i ++;
-            if (d->i >= d->idx->n) { // close handler
-                unlink(d->fn);
-                LOG_print("Unlink %s", d->fn);
-                fastq_node_clean(d);
-            }
-            else { // otherwise load new block to the buffer
-                int l = d->idx->length[d->i];
-                if (l >= d->m) {
-                    d->m = l+1;
-                    d->buf = realloc(d->buf, d->m);
-                }
-                d->n = l;
-                int ret;
-                ret = bgzf_read(d->fp, d->buf, d->n);
-                d->buf[d->n] = '\0';
-                assert(ret == d->n);
-                d->name = d->idx->name[d->i];
-            }
+    struct fastq_node *da = node[a], *db = node[b];
+    if (da->name == NULL) return 0;
+    if (db->name == NULL) return 1;
+    if (da->key != db->key) return da->key < db->key;
+    int c = (da->key & 0xff) == 0 ? 0 : strcmp(da->name+8, db->name+8); // short names are compared by key
+    return c == 0 ? a < b : c < 0;
+}
+// move block i of node into buffer, refill buffer from the file if block is not fully read
+static void node_load(struct fastq_node *d)
+{
+    d->off += d->n;
+    d->n = d->idx->length[d->i];
+    if (d->off + d->n <= d->l_buf) return;
+
+    d->l_buf -= d->off;
+    if (d->l_buf) memmove(d->buf, d->buf + d->off, d->l_buf);
+    d->off = 0;
+    if (d->n > d->m || d->m < MERGE_READ_AHEAD) {
+        d->m = d->n > MERGE_READ_AHEAD ? d->n : MERGE_READ_AHEAD;
+        d->buf = realloc(d->buf, d->m);
+    }
+    int ret = bgzf_read(d->fp, d->buf + d->l_buf, d->m - d->l_buf);
+    if (ret < 0 || d->l_buf + ret < d->n) error("Failed to read %s.", d->fn);
+    d->l_buf += ret;
+}
+// load next block of node, close the node if all blocks are written
+static void node_next(struct fastq_node *d)
+{
+    d->i ++;
+    if (d->i >= d->idx->n) { // close handler
+        unlink(d->fn);
+        tmp_bytes_add(-d->size);
+        LOG_print("Unlink %s", d->fn);
+        fastq_node_clean(d);
+        return;
+    }
+    node_load(d);
+    d->name = d->idx->name[d->i];
+    d->key = name_key(d->name);
+}
+// Loser tree of k nodes, tree[0] is the winner and tree[1..k-1] keep losers of internal matches.
+// Leaf of node i is k+i, so each emitted block costs log2(k) comparisons.
+static int loser_build(struct fastq_node **node, int *tree, int k, int t)
+{
+    if (t >= k) return t - k;
+    int a = loser_build(node, tree, k, t*2);
+    int b = loser_build(node, tree, k, t*2+1);
+    if (node_less(node, b, a)) { tree[t] = a; return b; }
+    tree[t] = b;
+    return a;
+}
+static void loser_replay(struct fastq_node **node, int *tree, int k)
+{
+    int w = tree[0];
+    int t;
+    for (t = (w + k)/2; t > 0; t /= 2) {
+        if (node_less(node, tree[t], w)) {
+            int tmp = tree[t];
+            tree[t] = w;
+            w = tmp;
         }
-        else break;
     }
-    free(name);
-    return length;
+    tree[0] = w;
 }
-struct fastq_idx *fastq_merge(struct fastq_node **node, int n_node, const char *fn)
+// merge sorted runs into fn, tag values of each block are kept if keep_vals is set
+struct fastq_idx *fastq_merge(struct fastq_node **node, int n_node, const char *fn, const char *mode, int keep_vals)
 {
     // init
-    BGZF *fp = bgzf_open(fn, "w");
+    BGZF *fp = bgzf_open(fn, mode);
     if (fp == NULL) error("%s : %s.", fn, strerror(errno));
-    bgzf_mt(fp, args.n_thread, 64);
+    if (args.pool) bgzf_thread_pool(fp, args.pool, 64);
     
     int i;
     
@@ -480,60 +773,58 @@ struct fastq_idx *fastq_merge(struct fastq_node **node, int n_node, const char *
         // bgzf_mt(d->fp, args.n_thread, 64);
         // debug_print("%s", d->fn);
         if (d->fp == NULL) error("%s : %s.", d->fn, strerror(errno));
+        d->i = 0;
+        d->off = d->n = d->l_buf = 0;
+        node_load(d);
         d->name = d->idx->name[0];
-        d->m = d->idx->length[0] + 1;
-        d->buf = malloc(d->m);
-        d->n = d->idx->length[0];
-        int ret = bgzf_read(d->fp, d->buf, d->n);
-        assert(ret == d->n);
-        d->buf[d->n] = '\0';
+        d->key = name_key(d->name);
     }
     
     // merge
-    int n = n_node;
     int m_idx = 0;
     struct fastq_idx *idx = malloc(sizeof(*idx));
     memset(idx, 0, sizeof(*idx));
+
+    int *tree = malloc((n_node+1)*sizeof(int));
+    if (n_node) tree[0] = loser_build(node, tree, n_node, 1);
     
-    for (;;) {
-        //if (n > 1) // todo: improve performation here
-        
-        qsort(node, n, sizeof(struct fastq_node*), merge_cmp);
-        
-        if (node[0]->name == NULL) break;
+    for (; n_node > 0;) {
+        struct fastq_node *d = node[tree[0]];
+        if (d->name == NULL) break;
 
         if (idx->n == m_idx) {
             m_idx = m_idx == 0 ? 1024 : m_idx*2;
             idx->name = realloc(idx->name, m_idx*sizeof(char*));
             idx->length = realloc(idx->length, m_idx*sizeof(int));
+            idx->records = realloc(idx->records, m_idx*sizeof(int));
+            if (keep_vals) idx->vals = realloc(idx->vals, m_idx*sizeof(char*));
         }
-        idx->name[idx->n] = strdup(node[0]->name);
-        
-        int l = fastq_merge_core(node, n, fp);
-        idx->length[idx->n] = l;
+        if (keep_vals) idx->vals[idx->n] = record_tag_values(d->buf + d->off);
+        char *name = strdup(d->name);
+        uint64_t key = d->key;
+        int length = 0;
+        int records = 0;
+        // write blocks of the same name from all nodes
+        while (d->name && d->key == key && strcmp(d->name, name) == 0) {
+            int ret = bgzf_write(fp, d->buf + d->off, d->n);
+            if (ret != d->n) error("Failed to write. %s", fn);
+            length += d->n;
+            records += d->idx->records[d->i];
+            node_next(d);
+            loser_replay(node, tree, n_node);
+            d = node[tree[0]];
+        }
+        idx->name[idx->n] = name;
+        idx->length[idx->n] = length;
+        idx->records[idx->n] = records;
         idx->n++;
     }
-    //for (i = 0; i < n_node; ++i) {
-    // node[i] is just a point to fastqs[i]::n, so just release the points
-    // free(node[i]);
-    //}
+    free(tree);
     bgzf_close(fp);
     LOG_print("Create %s from %d files.", fn, n_node);
     return idx;
 }
 
-struct fastq_idx *merge_files(struct fastq_stream *fastqs, int n, const char *fn)
-{
-    struct fastq_node **nodes = malloc(n*sizeof(struct fastq_node*));
-    int i;
-    for (i = 0; i < n; ++i) {
-        nodes[i] = fastqs[i].n;
-    }
-    struct fastq_idx *idx = fastq_merge(nodes, n, fn);
-    free(nodes);
-    return idx;
-}
-
 static void *run_it(void *d)
 {
     struct fastq_stream *fastq = (struct fastq_stream*)d;
@@ -541,153 +832,434 @@ static void *run_it(void *d)
     struct fastq_node *n = fastq->n;
 
     read_block_sort_by_name(r, args.tags);
-    n->idx = write_block_with_idx(n->fn, r);
+    n->idx = write_block_with_idx(n->fn, r, args.tmp_mode, 0);
     read_block_destroy(r);
+    if (n->idx) {
+        n->size = file_size(n->fn);
+        tmp_bytes_add(n->size);
+    }
     return fastq;
 }
 
-extern int fsort_usage();
-
-static const int max_file_open = 100;
+static char *tmp_fname(int i)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.%.4d.bgz", args.prefix, i);
+    return str.s;
+}
+// sorted runs, in the order of input
+struct fastq_runs {
+    int n, m;
+    struct fastq_node **node;
+    int i_name; // number of temp files created
+};
 
-int fsort(int argc, char **argv)
+static void runs_push(struct fastq_runs *runs, struct fastq_node *n)
 {
-    double t_real;
-    t_real = realtime();
+    if (runs->n == runs->m) {
+        runs->m = runs->m == 0 ? 64 : runs->m*2;
+        runs->node = realloc(runs->node, runs->m*sizeof(struct fastq_node*));
+    }
+    runs->node[runs->n++] = n;
+}
+static void read_runs(BGZF *fp, struct fastq_runs *runs)
+{
+    int end_of_file = 0;
+#pragma omp parallel shared(end_of_file) num_threads(args.n_thread)
+    for (;;) {
+        struct read_block *b = NULL;
+        struct fastq_node *node = NULL;
+#pragma omp critical (read)
+        {
+            if (end_of_file == 0) b = read_block_file(fp, args.mem_per_thread, args.paired, &end_of_file);
+            if (b == NULL) end_of_file = 1;
+            else {
+                // run order is input order, so records of a group keep input order after merge
+                node = malloc(sizeof(struct fastq_node));
+                memset(node, 0, sizeof(*node));
+                node->fn = tmp_fname(runs->i_name++);
+                runs_push(runs, node);
+            }
+        }
+        if (b == NULL) break;
+        struct fastq_stream stream = { b, node };
+        run_it(&stream);
+    }
+    // drop empty runs
+    int i, j;
+    for (i = j = 0; i < runs->n; ++i) {
+        if (runs->node[i]->idx) runs->node[j++] = runs->node[i];
+        else {
+            fastq_node_clean(runs->node[i]);
+            free(runs->node[i]);
+        }
+    }
+    runs->n = j;
+}
+// Runs are merged in groups of args.fan_in consecutive runs until no more than args.fan_in left.
+static void merge_passes(struct fastq_runs *runs)
+{
+    int pass = 0;
+    while (runs->n > args.fan_in) {
+        pass++;
+        args.peak_tmp_bytes = args.tmp_bytes; // peak of this pass
+        int n0 = runs->n;
+        int i, j;
+        for (i = j = 0; i < n0; i += args.fan_in) {
+            int k = n0 - i < args.fan_in ? n0 - i : args.fan_in;
+            if (k == 1) {
+                runs->node[j++] = runs->node[i];
+                continue;
+            }
+            struct fastq_node *n = malloc(sizeof(*n));
+            memset(n, 0, sizeof(*n));
+            n->fn = tmp_fname(runs->i_name++);
+            long before = args.tmp_bytes;
+            n->idx = fastq_merge(runs->node+i, k, n->fn, args.tmp_mode, 0);
+            n->size = file_size(n->fn);
+            tmp_bytes_add(n->size);
+            // inputs are removed while the output grows, so this is an upper bound
+            if (before + n->size > args.peak_tmp_bytes) args.peak_tmp_bytes = before + n->size;
+            int l;
+            for (l = i; l < i + k; ++l) free(runs->node[l]);
+            runs->node[j++] = n;
+        }
+        runs->n = j;
+        LOG_print("Merge pass %d: %d runs to %d runs; peak temp files %.3f GB; peak RSS %.3f GB.", pass, n0, j,
+                  args.peak_tmp_bytes / 1073741824.0, peakrss() / 1073741824.0);
+    }
+}
+// Convert sorted uncompressed offsets of fn into BGZF virtual offsets by walking block headers,
+// so the offsets do not depend on how compression threads flush blocks.
+static void bgzf_voffsets(const char *fn, uint64_t *off, int n)
+{
+    FILE *fp = fopen(fn, "rb");
+    if (fp == NULL) error("%s : %s.", fn, strerror(errno));
+    uint8_t h[18], t[4];
+    uint64_t caddr = 0, uaddr = 0;
+    int i = 0;
+    while (i < n && fread(h, 1, 18, fp) == 18) {
+        // htslib writes only the BC subfield, which keeps block size at bytes 16-17
+        if (h[0] != 31 || h[1] != 139 || h[10] != 6 || h[12] != 'B' || h[13] != 'C')
+            error("%s is not a BGZF file.", fn);
+        long bsize = (h[16] | h[17] << 8) + 1;
+        if (fseek(fp, caddr + bsize - 4, SEEK_SET) || fread(t, 1, 4, fp) != 4)
+            error("Truncated BGZF block in %s.", fn);
+        uint64_t isize = t[0] | t[1] << 8 | t[2] << 16 | (uint64_t)t[3] << 24;
+        for (; i < n && off[i] < uaddr + isize; ++i)
+            off[i] = caddr << 16 | (off[i] - uaddr);
+        caddr += bsize;
+        uaddr += isize;
+    }
+    // offsets at the end of file
+    for (; i < n; ++i) off[i] = caddr << 16;
+    fclose(fp);
+}
+// Sidecar index of sorted output, one line per block: tag values, virtual offset, records and bytes.
+static void write_index(const char *fn, struct fastq_idx *idx)
+{
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s%s", fn, FQ_INDEX_SUFFIX);
+    FILE *fp = fopen(str.s, "w");
+    if (fp == NULL) error("%s : %s.", str.s, strerror(errno));
+    uint64_t *off = malloc((idx->n+1)*sizeof(uint64_t));
+    uint64_t l = 0;
+    int i;
+    for (i = 0; i < idx->n; ++i) {
+        off[i] = l;
+        l += idx->length[i];
+    }
+    bgzf_voffsets(fn, off, idx->n);
+    fputc('#', fp);
+    for (i = 0; i < dict_size(args.tags); ++i) fprintf(fp, "%s\t", dict_name(args.tags, i));
+    fputs("voffset\trecords\tbytes\n", fp);
+    for (i = 0; i < idx->n; ++i)
+        fprintf(fp, "%s\t%" PRIu64 "\t%d\t%d\n", idx->vals[i], off[i], idx->records[i], idx->length[i]);
+    if (fclose(fp)) error("%s : %s.", str.s, strerror(errno));
+    LOG_print("Index %d blocks to %s.", idx->n, str.s);
+    free(off);
+    free(str.s);
+}
+// open files and memory of merge limit the number of runs merged at once
+static void set_fan_in()
+{
+    struct rlimit rl;
+    long files = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) files = rl.rlim_cur;
+    // keep files for input, output and standard streams
+    files -= 16;
+    if (args.mem_budget) {
+        long per_run = MERGE_READ_AHEAD + 2*0x10000; // read ahead and BGZF buffers
+        long mem = args.mem_budget / per_run;
+        if (mem < files) files = mem;
+    }
+    if (files > 4096) files = 4096;
+    if (files < 2) files = 2;
+    args.fan_in = files;
+}
 
-    if (parse_args(argc, argv)) return fsort_usage();
-    
-    BGZF *fp = bgzf_open(args.input_fname, "r");
-    if (fp == NULL) error("%s : %s.", args.input_fname, strerror(errno));
+// Hash-partitioned grouping. Input is read once and records are spread into bucket files by a
+// hash of the first tag value, then each bucket is sorted in memory by its own thread. Records of
+// a barcode are contiguous in the output but barcodes are not sorted, and no k-way merge is needed.
+static const uint8_t bgzf_eof_block[28] = "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
 
-    //int type = bgzf_compression(fp);
-    /* if (type == 2)  */
-    /*     bgzf_mt(fp, args.n_thread, 256); */
-    
-    int n_file = 0;
-    int i_name = 0;
-    struct fastq_stream *fastqs = malloc(max_file_open*sizeof(struct fastq_stream));
+struct buckets {
+    int n;
+    char **fn;
+    FILE **fp;
+    int level; // BGZF level of bucket files, -2 for raw
+    // blocks are appended in input order, so records of a group keep input order
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    int next; // block to append next
+};
+
+static int record_bucket(const char *p, int n)
+{
+    const char *v = NULL;
+    int l = record_tag_value(p, dict_name(args.tags, 0), &v);
+    if (l < 0) error("No tag found at %s", p);
+    uint32_t h = 2166136261U; // FNV-1a
     int i;
-    for (i = 0; i < max_file_open; ++i) {
-        fastqs[i].n = malloc(sizeof(struct fastq_node));
-        memset(fastqs[i].n, 0, sizeof(struct fastq_node));
-        fastqs[i].r = NULL;
+    for (i = 0; i < l; ++i) h = (h ^ (uint8_t)v[i]) * 16777619U;
+    return h % n;
+}
+// compress str into BGZF blocks at the end of out
+static void bucket_compress(kstring_t *str, kstring_t *out, int level)
+{
+    size_t i;
+    for (i = 0; i < str->l; i += BGZF_BLOCK_SIZE) {
+        size_t l = str->l - i < BGZF_BLOCK_SIZE ? str->l - i : BGZF_BLOCK_SIZE;
+        size_t dlen = BGZF_MAX_BLOCK_SIZE;
+        ks_resize(out, out->l + dlen);
+        if (bgzf_compress(out->s + out->l, &dlen, str->s + i, l, level)) error("Failed to compress bucket.");
+        out->l += dlen;
+    }
+}
+// spread records of block seq into buckets, compressed by the calling thread
+static void bucket_partition(struct buckets *b, struct read_block *r, int seq)
+{
+    kstring_t *str = calloc(b->n, sizeof(kstring_t));
+    int i;
+    for (i = 0; i < r->max; ) {
+        const char *p = (char*)r->data + i;
+        int l = strlen(p);
+        kstring_t *s = &str[record_bucket(p, b->n)];
+        kputsn(p, l, s);
+        kputc('\n', s);
+        i += l + 1;
+    }
+    if (b->level != -2) {
+        kstring_t out = {0,0,0};
+        for (i = 0; i < b->n; ++i) {
+            out.l = 0;
+            bucket_compress(&str[i], &out, b->level);
+            kstring_t tmp = str[i];
+            str[i] = out;
+            out = tmp;
+        }
+        free(out.s);
+    }
+    pthread_mutex_lock(&b->lock);
+    while (b->next != seq) pthread_cond_wait(&b->turn, &b->lock);
+    pthread_mutex_unlock(&b->lock);
+    for (i = 0; i < b->n; ++i) {
+        if (str[i].l && fwrite(str[i].s, 1, str[i].l, b->fp[i]) != str[i].l)
+            error("%s : %s.", b->fn[i], strerror(errno));
+        free(str[i].s);
+    }
+    free(str);
+    pthread_mutex_lock(&b->lock);
+    b->next++;
+    pthread_cond_broadcast(&b->turn);
+    pthread_mutex_unlock(&b->lock);
+}
+// sort records of bucket fn in memory and write them to out
+static struct fastq_idx *bucket_group(const char *fn, long size, const char *out)
+{
+    BGZF *fp = bgzf_open(fn, "r");
+    if (fp == NULL) error("%s : %s.", fn, strerror(errno));
+    int eof = 0;
+    struct read_block *r = read_block_file(fp, BUCKET_MAX, args.paired, &eof);
+    if (eof == 0) error("Bucket %s is too large to group in memory, try more buckets.", fn);
+    bgzf_close(fp);
+    unlink(fn);
+    tmp_bytes_add(-size);
+    if (r == NULL) return NULL;
+    read_block_sort_by_name(r, args.tags);
+    struct fastq_idx *idx = write_block_with_idx(out, r, "w", 1);
+    read_block_destroy(r);
+    return idx;
+}
+// concatenate BGZF files into fn, end of file blocks are removed except the last one
+static void bucket_concat(char **files, int n, const char *fn)
+{
+    FILE *out = fopen(fn, "wb");
+    if (out == NULL) error("%s : %s.", fn, strerror(errno));
+    char *buf = malloc(MERGE_READ_AHEAD);
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (files[i] == NULL) continue;
+        long size = file_size(files[i]);
+        FILE *fp = fopen(files[i], "rb");
+        if (fp == NULL) error("%s : %s.", files[i], strerror(errno));
+        long left = size - 28;
+        while (left > 0) {
+            size_t l = left < MERGE_READ_AHEAD ? left : MERGE_READ_AHEAD;
+            if (fread(buf, 1, l, fp) != l) error("Failed to read %s.", files[i]);
+            if (fwrite(buf, 1, l, out) != l) error("%s : %s.", fn, strerror(errno));
+            left -= l;
+        }
+        if (fread(buf, 1, 28, fp) != 28 || memcmp(buf, bgzf_eof_block, 28) != 0)
+            error("No end of file block in %s.", files[i]);
+        fclose(fp);
+        unlink(files[i]);
+        tmp_bytes_add(-size);
+    }
+    if (fwrite(bgzf_eof_block, 1, 28, out) != 28 || fclose(out)) error("%s : %s.", fn, strerror(errno));
+    free(buf);
+}
+static void fsort_bucket(BGZF *fp)
+{
+    struct buckets b;
+    memset(&b, 0, sizeof(b));
+    b.n = args.n_bucket;
+    b.level = strcmp(args.tmp_mode, "wu") == 0 ? -2 : strcmp(args.tmp_mode, "w1") == 0 ? 1 : -1;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.turn, NULL);
+    b.fn = malloc(b.n*sizeof(char*));
+    b.fp = malloc(b.n*sizeof(FILE*));
+    int i;
+    for (i = 0; i < b.n; ++i) {
+        b.fn[i] = tmp_fname(i);
+        b.fp[i] = fopen(b.fn[i], "wb");
+        if (b.fp[i] == NULL) error("%s : %s.", b.fn[i], strerror(errno));
     }
-    // int i=0;
 
+    int seq = 0;
     int end_of_file = 0;
+#pragma omp parallel shared(end_of_file, seq) num_threads(args.n_thread)
     for (;;) {
-        // i++;
-        if (end_of_file ==1) break;
-        if (n_file >= max_file_open) {
-            char *name = calloc(strlen(args.prefix)+20,1);
-            sprintf(name, "%s.%.4d.bgz", args.prefix, i_name);
-            i_name++;
-            
-            struct fastq_idx *idx = merge_files(fastqs, n_file, name);
-            // memset(fastqs, 0, sizeof(struct fastq_stream)*max_file_open);
-            // fastqs[0].n = malloc(sizeof(struct fastq_node));
-            // memset(fastqs[0].n, 0, sizeof(struct fastq_node));
-            fastqs[0].n->idx = idx;
-            fastqs[0].n->fn = name;
-
-            n_file = 1; // merged file will put as the first record in the list
+        struct read_block *r = NULL;
+        int s = 0;
+#pragma omp critical (read)
+        {
+            if (end_of_file == 0) r = read_block_file(fp, args.mem_per_thread, args.paired, &end_of_file);
+            if (r == NULL) end_of_file = 1;
+            else s = seq++;
+        }
+        if (r == NULL) break;
+        bucket_partition(&b, r, s);
+        read_block_destroy(r);
+    }
 
+    long *size = malloc(b.n*sizeof(long));
+    for (i = 0; i < b.n; ++i) {
+        if (b.level != -2 && fwrite(bgzf_eof_block, 1, 28, b.fp[i]) != 28)
+            error("%s : %s.", b.fn[i], strerror(errno));
+        if (fclose(b.fp[i])) error("%s : %s.", b.fn[i], strerror(errno));
+        size[i] = file_size(b.fn[i]);
+        tmp_bytes_add(size[i]);
+    }
+    LOG_print("Partition %d blocks into %d buckets; temp files %.3f GB.", seq, b.n, args.tmp_bytes / 1073741824.0);
+
+    char **out = malloc(b.n*sizeof(char*));
+    struct fastq_idx **idx = malloc(b.n*sizeof(struct fastq_idx*));
+#pragma omp parallel for schedule(dynamic) num_threads(args.n_thread)
+    for (i = 0; i < b.n; ++i) {
+        out[i] = tmp_fname(b.n + i);
+        idx[i] = bucket_group(b.fn[i], size[i], out[i]);
+        if (idx[i]) tmp_bytes_add(file_size(out[i]));
+        else {
+            free(out[i]);
+            out[i] = NULL;
         }
-        // debug_print("%d", omp_in_parallel());
+    }
+    LOG_print("Group %d buckets; peak temp files %.3f GB; peak RSS %.3f GB.", b.n,
+              args.peak_tmp_bytes / 1073741824.0, peakrss() / 1073741824.0);
+
+    bucket_concat(out, b.n, args.output_fname);
+
+    // index of all buckets, in the order of output
+    struct fastq_idx *all = malloc(sizeof(*all));
+    memset(all, 0, sizeof(*all));
+    for (i = 0; i < b.n; ++i)
+        if (idx[i]) all->n += idx[i]->n;
+    all->name = malloc(all->n*sizeof(char*));
+    all->length = malloc(all->n*sizeof(int));
+    all->records = malloc(all->n*sizeof(int));
+    all->vals = malloc(all->n*sizeof(char*));
+    int n = 0;
+    for (i = 0; i < b.n; ++i) {
+        if (idx[i] == NULL) continue;
+        memcpy(all->name + n, idx[i]->name, idx[i]->n*sizeof(char*));
+        memcpy(all->length + n, idx[i]->length, idx[i]->n*sizeof(int));
+        memcpy(all->records + n, idx[i]->records, idx[i]->n*sizeof(int));
+        memcpy(all->vals + n, idx[i]->vals, idx[i]->n*sizeof(char*));
+        n += idx[i]->n;
+        idx[i]->n = 0; // names and values are moved
+        fastq_idx_destroy(idx[i]);
+        free(out[i]);
+    }
+    write_index(args.output_fname, all);
+    fastq_idx_destroy(all);
+
+    for (i = 0; i < b.n; ++i) free(b.fn[i]);
+    free(b.fn);
+    free(b.fp);
+    free(size);
+    free(out);
+    free(idx);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.turn);
+}
 
-#pragma omp parallel shared(i_name, n_file, end_of_file) num_threads(args.n_thread)
-        for (;;) {
-            if (n_file >= max_file_open) break;
-            if (end_of_file == 1) break;
+extern int fsort_usage();
 
-            struct read_block *b;
-#pragma omp critical (read)
-            b = read_block_file(fp, args.mem_per_thread, args.paired);
-            if (b == NULL) {
-                end_of_file = 1;
-                break;
-            }
-            struct fastq_stream *stream = &fastqs[n_file];
+int fsort(int argc, char **argv)
+{
+    double t_real;
+    t_real = realtime();
 
-#pragma omp atomic
-            n_file++;
-        
-            char *name = calloc(strlen(args.prefix)+20,1);
-            sprintf(name, "%s.%.4d.bgz", args.prefix, i_name);
+    if (parse_args(argc, argv)) return fsort_usage();
+    set_fan_in();
+    
+    BGZF *fp = bgzf_open(args.input_fname, "r");
+    if (fp == NULL) error("%s : %s.", args.input_fname, strerror(errno));
 
-#pragma omp atomic
-            i_name++;
-            
-            stream->r = b;
-            stream->n->fn = name;
-            
-            run_it(stream);
-        }
+    // BGZF input (e.g. parse -1 out.fq.gz) is inflated by the thread pool
+    if (bgzf_compression(fp) == bgzf && args.n_thread > 1)
+        bgzf_mt(fp, args.n_thread, 256);
+
+    if (args.n_bucket) {
+        fsort_bucket(fp);
+        bgzf_close(fp);
+        memory_release();
+        LOG_print("Real time: %.3f sec; CPU: %.3f sec; Peak RSS: %.3f GB.", realtime() - t_real, cputime(), peakrss() / 1073741824.0);
+        return 0;
     }
 
+    struct fastq_runs runs = {0,0,NULL,0};
+    read_runs(fp, &runs);
+    bgzf_close(fp);
+    LOG_print("Create %d runs; temp files %.3f GB; peak RSS %.3f GB.", runs.n,
+              args.peak_tmp_bytes / 1073741824.0, peakrss() / 1073741824.0);
 
-    /* if (args.dedup) { */
-    /*     char *name = calloc(strlen(args.prefix)+20,1); */
-    /*     sprintf(name, "%s.all.bgz", args.prefix); */
-    /*     struct fastq_idx *idx = merge_files(fastqs, n_file, name); */
-        
-    /*     BGZF *fp = bgzf_open(name, "r");         */
-    /*     if (fp == NULL) */
-    /*         error("%s : %s.", name, strerror(errno)); */
-    /*     bgzf_mt(fp, args.n_thread, 256); */
-        
-    /*     BGZF *out = bgzf_open(args.output_fname, "w"); */
-    /*     if (out == NULL) error("%s : %s.", args.output_fname, strerror(errno)); */
-    /*     bgzf_mt(out, args.n_thread, 256); */
-        
-    /*     int i; */
-    /*     for (i = 0; i < idx->n; ++i) { */
-    /*         int l = idx->length[i]; */
-    /*         char *buf = malloc(l+1); */
-    /*         int ret = bgzf_read(fp, buf, l); */
-    /*         assert(ret == l); */
-    /*         buf[l] = '\0'; */
-    /*         struct fastq_dedup_pool *dp = (struct fastq_dedup_pool*)dedup_str(buf); */
-    /*         dedup_write(dp, out); */
-    /*     } */
-    /*     unlink(name); */
-    /*     free(name); */
-    /*     bgzf_close(fp); */
-    /*     bgzf_close(out); */
-    /*     if (args.report_fname) { */
-    /*         FILE *re = fopen(args.report_fname, "w"); */
-    /*         fprintf(re, "All reads,%d\n", args.read_counts); */
-    /*         fprintf(re, "Deduplicated reads,%d\n", args.nondup); */
-    /*         fclose(re); */
-    /*     } */
-        
-    /*     LOG_print("All reads : %d", args.read_counts); */
-    /*     LOG_print("Deduplicated reads : %d", args.nondup); */
-    /*     fastq_idx_destroy(idx); */
-    /* } */
-    /* else { */
-    char *name = strdup(args.output_fname);
-    struct fastq_idx *idx = merge_files(fastqs, n_file, name);
-    free(name);
+    merge_passes(&runs);
+    
+    struct fastq_idx *idx = fastq_merge(runs.node, runs.n, args.output_fname, "w", 1);
+    write_index(args.output_fname, idx);
     fastq_idx_destroy(idx);
-    /* } */
 
-    // int i;
-    for (i = 0; i < max_file_open; ++i) {
-        if (fastqs[i].n) {
-            fastq_node_clean(fastqs[i].n);
-            free(fastqs[i].n);
-        }
-        //read_block_destroy(fastqs->b[i]);
+    int i;
+    for (i = 0; i < runs.n; ++i) {
+        fastq_node_clean(runs.node[i]);
+        free(runs.node[i]);
     }
-    //free(fastqs->n);
-    //free(fastqs->b);
-    free(fastqs);
+    free(runs.node);
 
-    bgzf_close(fp);
     memory_release();
-    LOG_print("Real time: %.3f sec; CPU: %.3f sec", realtime() - t_real, cputime());
+    LOG_print("Real time: %.3f sec; CPU: %.3f sec; Peak RSS: %.3f GB.", realtime() - t_real, cputime(), peakrss() / 1073741824.0);
 
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // memfd_create
 #include "utils.h"
 #include "fastq.h"
 #include "number.h"
@@ -5,6 +6,16 @@
 #include "fastq.h"
 #include "read_tags.h"
 #include "htslib/thread_pool.h"
+#include "stream_plugin.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 /*
 #ifdef _OPENMP
 #include <omp.h>
@@ -15,8 +26,12 @@ static struct args {
     const char *output_fname;
     const char *report_fname;
     const char *script;
+    const char *worker_cmd; // run blocks through long-lived workers instead of a script per block
+    const char *plugin_fname; // process blocks in this shared object instead of a script
+    const char *plugin_arg;
     const char *tags_str;
     const char *tempdir;
+    const char *list_fname; // only stream blocks of these barcodes, by index of fsort
     struct dict *tags;
     
     int min_reads_per_block;
@@ -37,14 +52,20 @@ static struct args {
     
     int keep_temp;
     int stream_input_fasta;
+    int memfd; // pass blocks to script by anonymous memory files
+    int use_tempdir; // create a temp directory for each block, only for -script without -memfd
     FILE *fout;    
 } args = {
     .input_fname  = NULL,
     .output_fname = NULL,
     .report_fname = NULL,
     .script       = NULL,
+    .worker_cmd   = NULL,
+    .plugin_fname = NULL,
+    .plugin_arg   = NULL,
     .tags_str     = NULL,
     .tempdir      = "_PISA_stream_tempdir",
+    .list_fname   = NULL,
     .tags         = NULL,
     .min_reads_per_block = 2,
     .max_reads_per_block = 8000,
@@ -54,18 +75,23 @@ static struct args {
     .run_script   = NULL,
     .keep_temp    = 0,
     .stream_input_fasta = 0,
+    .memfd        = 0,
+    .use_tempdir  = 1,
     .fout         = NULL,
 };
 
 static void memory_release()
 {
-    kstring_t run = {0,0,0};
-    kputs("rm -rf ", &run);
-    kputs(args.tempdir, &run);
-    if (system(run.s) == -1) warnings("Failed to run %s", run.s);
-    free(run.s);
+    if (args.use_tempdir) {
+        kstring_t run = {0,0,0};
+        kputs("rm -rf ", &run);
+        kputs(args.tempdir, &run);
+        if (system(run.s) == -1) warnings("Failed to run %s", run.s);
+        free(run.s);
+    }
     if (args.run_script) free(args.run_script);
     fastq_handler_destory(args.fastq);    
+    bseq_pool_free_list_destroy();
 }
 
 static int parse_args(int argc, char **argv)
@@ -85,8 +111,12 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-tags") == 0) var = &args.tags_str;
         else if (strcmp(a, "-tmpdir") == 0) var = &args.tempdir;
         else if (strcmp(a, "-script") == 0) var = &args.script;
+        else if (strcmp(a, "-worker") == 0) var = &args.worker_cmd;
+        else if (strcmp(a, "-plugin") == 0) var = &args.plugin_fname;
+        else if (strcmp(a, "-plugin-arg") == 0) var = &args.plugin_arg;
         else if (strcmp(a, "-min") == 0) var = &min;
         else if (strcmp(a, "-max") == 0) var = &max;
+        else if (strcmp(a, "-list") == 0) var = &args.list_fname;
         else if (strcmp(a, "-nw") == 0) {
             args.no_warnings = 1;
             continue;
@@ -99,6 +129,10 @@ static int parse_args(int argc, char **argv)
             args.stream_input_fasta = 1;
             continue;
         }
+        else if (strcmp(a, "-memfd") == 0) {
+            args.memfd = 1;
+            continue;
+        }
         else if (strcmp(a, "-keep") == 0) {
             args.keep_processed = 1;
             continue;
@@ -117,7 +151,13 @@ static int parse_args(int argc, char **argv)
     }
 
     if (args.input_fname == NULL ) error("No input fastq specified.");    
-    if (args.script == NULL) error("No -script specified.");
+    if ((args.script != NULL) + (args.worker_cmd != NULL) + (args.plugin_fname != NULL) != 1)
+        error("One of -script, -worker and -plugin should be specified.");
+#ifndef __linux__
+    if (args.memfd) error("-memfd is only supported on Linux.");
+#endif
+    if (args.memfd && args.script == NULL) warnings("-memfd is only used with -script.");
+    args.use_tempdir = args.script != NULL && args.memfd == 0;
     args.fout = args.output_fname == NULL ? stdout : fopen(args.output_fname, "w");
     if (args.fout == NULL) error("%s : %s.", args.output_fname, strerror(errno));
     
@@ -132,12 +172,19 @@ static int parse_args(int argc, char **argv)
     
     struct stat st = {0};
 
-    if (stat(args.tempdir, &st) == -1) {
+    if (args.use_tempdir && stat(args.tempdir, &st) == -1) {
         mkdir(args.tempdir, 0700);
     }
 
     args.fastq = fastq_handler_init(args.input_fname, NULL, NULL, NULL, 0, 0);
     if (args.fastq == NULL) error("%s : %s.", args.input_fname, strerror(errno));
+    fastq_handler_set_threads(args.fastq, args.n_thread);
+    if (args.list_fname) {
+        struct dict *list = dict_init();
+        if (dict_read(list, args.list_fname, 0)) error("Barcode list is empty.");
+        fastq_handler_select(args.fastq, list);
+        dict_destroy(list);
+    }
     return 0;    
 }
 
@@ -186,6 +233,282 @@ static struct bseq_pool *stream_process(const char *run_script, struct bseq_pool
     return out;
 }
 
+#ifdef __linux__
+// Private working directory of a block script, on memory-backed storage if possible. Scripts of
+// different blocks run at the same time, so they should not share a directory for their own files.
+static char *memfd_workdir(const char *unique_block_name)
+{
+    const char *base = "/dev/shm";
+    if (access(base, W_OK | X_OK) != 0) {
+        base = getenv("TMPDIR");
+        if (base == NULL || *base == '\0') base = "/tmp";
+    }
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/PISA_stream_%s_XXXXXX", base, unique_block_name);
+    if (mkdtemp(str.s) == NULL) error("Failed to create directory %s : %s.", str.s, strerror(errno));
+    return str.s;
+}
+
+// Block is kept in an anonymous memory file and the script reads it by the /proc path of this
+// process, so nothing is written under -tmpdir. Output is read from the stdout pipe as usual.
+static struct bseq_pool *stream_process_memfd(const char *run_script, struct bseq_pool *in, char *unique_block_name)
+{
+    // close on exec, so scripts of other blocks do not hold it
+    int fd = memfd_create(unique_block_name, MFD_CLOEXEC);
+    if (fd < 0) error("Failed to create memory file : %s.", strerror(errno));
+    // dup() clears close on exec, the copy may leak to scripts started before fclose()
+    int fd1 = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd1 < 0) error("Failed to duplicate memory file : %s.", strerror(errno));
+    FILE *fp = fdopen(fd1, "w");
+    if (fp == NULL) error("Failed to open memory file : %s.", strerror(errno));
+    bseq_pool_write_fp(in, fp);
+    if (fclose(fp)) error("Failed to write memory file : %s.", strerror(errno));
+
+    char *workdir = memfd_workdir(unique_block_name);
+    kstring_t script = {0,0,0};
+    ksprintf(&script, "cd \"%s\" || exit 1; ", workdir);
+    ksprintf(&script, "export FQ=\"/proc/%d/fd/%d\"; ", (int)getpid(), fd);
+    ksprintf(&script, "export UBI=\"%s\"; ", unique_block_name);
+    kputs(run_script, &script);
+
+    struct bseq_pool *out = NULL;
+    fp = popen(script.s, "r");
+    if (fp == NULL) {
+        if (args.no_warnings == 0)
+            warnings("Failed to process read block %s : %s.", unique_block_name, strerror(errno));
+    }
+    else {
+        out = bseq_pool_cache_fp(fp, 0);
+        pclose(fp);
+    }
+    close(fd);
+
+    if (args.keep_temp == 0) {
+        script.l = 0;
+        ksprintf(&script, "rm -rf \"%s\"", workdir);
+        if (system(script.s) == -1) warnings("Failed to run %s", script.s);
+    }
+    free(script.s);
+    free(workdir);
+    return out;
+}
+#else
+static struct bseq_pool *stream_process_memfd(const char *run_script, struct bseq_pool *in, char *unique_block_name)
+{
+    error("-memfd is only supported on Linux.");
+    return NULL;
+}
+#endif
+
+static struct {
+    void *handle;
+    stream_plugin_init_func init;
+    stream_plugin_process_func process_block;
+    stream_plugin_finish_func finish;
+} plugin;
+
+static void plugin_load(const char *fn, const char *arg)
+{
+    // -plugin is a file like -script, so a name without slash is loaded from current directory
+    // instead of being searched in library paths by dlopen
+    kstring_t path = {0,0,0};
+    if (strchr(fn, '/') == NULL) kputs("./", &path);
+    kputs(fn, &path);
+    plugin.handle = dlopen(path.s, RTLD_NOW | RTLD_LOCAL);
+    free(path.s);
+    if (plugin.handle == NULL) error("Failed to load plugin : %s.", dlerror());
+    plugin.init = (stream_plugin_init_func)dlsym(plugin.handle, "init");
+    plugin.process_block = (stream_plugin_process_func)dlsym(plugin.handle, "process_block");
+    plugin.finish = (stream_plugin_finish_func)dlsym(plugin.handle, "finish");
+    if (plugin.init == NULL || plugin.process_block == NULL || plugin.finish == NULL)
+        error("Plugin %s should export init, process_block and finish.", fn);
+    if (plugin.init(arg)) error("Failed to init plugin %s.", fn);
+    LOG_print("Load plugin %s.", fn);
+}
+static void plugin_unload()
+{
+    plugin.finish();
+    dlclose(plugin.handle);
+}
+static struct bseq_pool *plugin_process(struct bseq_pool *in, const char *unique_block_name)
+{
+    struct bseq_pool *out = bseq_pool_get(in->n);
+    if (plugin.process_block(in, out)) error("Plugin failed at block %s.", unique_block_name);
+    if (out->n == 0) {
+        bseq_pool_recycle(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Long-lived workers of -worker, started once and fed with blocks on stdin. Each block is sent as
+//   #BLOCK UBI\n<FASTQ records>#END UBI\n
+// and the worker writes its records of this block to stdout, then the same #END UBI line. A space is
+// never part of a quality string, so these lines cannot be taken as records.
+struct worker {
+    pid_t pid;
+    int in, out; // stdin and stdout of worker
+    int busy;
+};
+
+static struct {
+    int n;
+    struct worker *w;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+} workers;
+
+static void worker_start(struct worker *w, const char *cmd)
+{
+    int in[2], out[2];
+    if (pipe(in) || pipe(out)) error("Failed to create pipe : %s.", strerror(errno));
+    w->pid = fork();
+    if (w->pid < 0) error("Failed to fork : %s.", strerror(errno));
+    if (w->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    w->in = in[1];
+    w->out = out[0];
+    // not inherited by later workers, so a worker sees end of input once its pipe is closed
+    fcntl(w->in, F_SETFD, FD_CLOEXEC);
+    fcntl(w->out, F_SETFD, FD_CLOEXEC);
+    fcntl(w->in, F_SETFL, O_NONBLOCK);
+    w->busy = 0;
+}
+static void workers_start(const char *cmd, int n)
+{
+    // a dead worker is reported by write error instead of killing us
+    signal(SIGPIPE, SIG_IGN);
+    workers.n = n;
+    workers.w = malloc(n*sizeof(struct worker));
+    pthread_mutex_init(&workers.lock, NULL);
+    pthread_cond_init(&workers.idle, NULL);
+    int i;
+    for (i = 0; i < n; ++i) worker_start(&workers.w[i], cmd);
+    LOG_print("Start %d workers.", n);
+}
+static void workers_stop()
+{
+    int i;
+    for (i = 0; i < workers.n; ++i) {
+        struct worker *w = &workers.w[i];
+        close(w->in);
+        close(w->out);
+        int status;
+        if (waitpid(w->pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            warnings("Worker %d exited abnormally.", (int)w->pid);
+    }
+    free(workers.w);
+    pthread_mutex_destroy(&workers.lock);
+    pthread_cond_destroy(&workers.idle);
+}
+static struct worker *worker_get()
+{
+    pthread_mutex_lock(&workers.lock);
+    struct worker *w = NULL;
+    for (;;) {
+        int i;
+        for (i = 0; i < workers.n && workers.w[i].busy; ++i);
+        if (i < workers.n) {
+            w = &workers.w[i];
+            w->busy = 1;
+            break;
+        }
+        pthread_cond_wait(&workers.idle, &workers.lock);
+    }
+    pthread_mutex_unlock(&workers.lock);
+    return w;
+}
+static void worker_put(struct worker *w)
+{
+    pthread_mutex_lock(&workers.lock);
+    w->busy = 0;
+    pthread_cond_signal(&workers.idle);
+    pthread_mutex_unlock(&workers.lock);
+}
+// Write in to worker and read its output until the end line. Both pipes are polled, so a worker
+// writing large output before reading the whole block does not block us.
+static void worker_exchange(struct worker *w, kstring_t *in, kstring_t *out, const char *end)
+{
+    size_t sent = 0;
+    int l_end = strlen(end);
+    out->l = 0;
+    for (;;) {
+        struct pollfd fds[2] = {
+            { w->out, POLLIN, 0 },
+            { w->in, sent < in->l ? POLLOUT : 0, 0 },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            error("Failed to poll worker %d : %s.", (int)w->pid, strerror(errno));
+        }
+        if (sent < in->l && fds[1].revents) {
+            ssize_t ret = write(w->in, in->s + sent, in->l - sent);
+            if (ret < 0 && errno != EAGAIN && errno != EINTR)
+                error("Failed to write to worker %d : %s.", (int)w->pid, strerror(errno));
+            if (ret > 0) sent += ret;
+        }
+        if (fds[0].revents == 0) continue;
+        ks_resize(out, out->l + 0x10000 + 1);
+        ssize_t ret = read(w->out, out->s + out->l, 0x10000);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            error("Failed to read from worker %d : %s.", (int)w->pid, strerror(errno));
+        }
+        if (ret == 0) error("Worker %d exited before end of block.", (int)w->pid);
+        out->l += ret;
+        out->s[out->l] = '\0';
+        if (out->l >= l_end && memcmp(out->s + out->l - l_end, end, l_end) == 0 &&
+            (out->l == l_end || out->s[out->l - l_end - 1] == '\n')) {
+            if (sent < in->l) error("Worker %d ended block before reading it.", (int)w->pid);
+            out->l -= l_end;
+            out->s[out->l] = '\0';
+            return;
+        }
+    }
+}
+static struct bseq_pool *worker_process(struct bseq_pool *in, const char *unique_block_name)
+{
+    kstring_t end = {0,0,0};
+    ksprintf(&end, "#END %s\n", unique_block_name);
+
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&buf, &size);
+    if (fp == NULL) error("Failed to create memory stream : %s.", strerror(errno));
+    fprintf(fp, "#BLOCK %s\n", unique_block_name);
+    bseq_pool_write_fp(in, fp);
+    fputs(end.s, fp);
+    fclose(fp);
+
+    kstring_t block = { size, size, buf };
+    kstring_t out = {0,0,0};
+    struct worker *w = worker_get();
+    worker_exchange(w, &block, &out, end.s);
+    worker_put(w);
+    free(buf);
+    free(end.s);
+
+    struct bseq_pool *p = NULL;
+    if (out.l > 0) {
+        fp = fmemopen(out.s, out.l, "r");
+        if (fp == NULL) error("Failed to open memory stream : %s.", strerror(errno));
+        p = bseq_pool_cache_fp(fp, 0);
+        fclose(fp);
+    }
+    free(out.s);
+    return p;
+}
+
 // Run script example.
 // "seqtk seq -A $FQ > input.fa && cap3 input.fa -r 0 -a 2 && seqtk rename $UBI_ input.fa.cap.contigs 1> contigs.fa && cat contigs.fa test.fa.cap.singlets"
 
@@ -224,7 +547,7 @@ static void write_out(struct bseq_pool *p)
             if (vals[i]) free(vals[i]);
         free(vals);
     }
-    bseq_pool_destroy(p);
+    bseq_pool_recycle(p);
 }
 static void *run_it(void *_data)
 {
@@ -238,7 +561,7 @@ static void *run_it(void *_data)
             for (i = 0; i < n; ++i)
                 if (vals[i]) free(vals[i]);
             free(vals);
-            bseq_pool_destroy(p);
+            bseq_pool_recycle(p);
             return NULL;
         }
         if (args.stream_input_fasta == 1) p->force_fasta = 1;
@@ -249,10 +572,16 @@ static void *run_it(void *_data)
     char *ubi = vals2str(p->opts, dict_size(args.tags));
 
     kstring_t tempdir0 = {0,0,0};
-    kputs(args.tempdir, &tempdir0);
-    if (tempdir0.s[tempdir0.l-1] != '/') kputc('/', &tempdir0);
-    kputs(ubi, &tempdir0);
-    struct bseq_pool *ret_p = stream_process(args.run_script, p, tempdir0.s, ubi);
+    struct bseq_pool *ret_p;
+    if (args.plugin_fname) ret_p = plugin_process(p, ubi);
+    else if (args.worker_cmd) ret_p = worker_process(p, ubi);
+    else if (args.memfd) ret_p = stream_process_memfd(args.run_script, p, ubi);
+    else {
+        kputs(args.tempdir, &tempdir0);
+        if (tempdir0.s[tempdir0.l-1] != '/') kputc('/', &tempdir0);
+        kputs(ubi, &tempdir0);
+        ret_p = stream_process(args.run_script, p, tempdir0.s, ubi);
+    }
     
     if (ret_p == NULL) {
         if (args.no_warnings == 0) warnings("Block %s has zero output.", ubi);
@@ -278,11 +607,11 @@ static void *run_it(void *_data)
     for (i = 0; i < n; ++i)
         if (vals[i]) free(vals[i]);
     free(vals);
-    bseq_pool_destroy(p);
+    bseq_pool_recycle(p);
 
     free(ubi);
 
-    if (args.keep_temp == 0) {
+    if (args.use_tempdir && args.keep_temp == 0) {
         kstring_t str = {0,0,0};
         kputs("rm -rf ", &str);
         kputs(tempdir0.s, &str);
@@ -302,10 +631,15 @@ int fastq_stream(int argc, char **argv)
     
     if (parse_args(argc, argv)) return fastq_stream_usage();
     
-    args.run_script = stream_script_format(args.script);
-    if (args.run_script == NULL) error("Empty run script?");
+    if (args.plugin_fname) plugin_load(args.plugin_fname, args.plugin_arg);
+    else {
+        args.run_script = stream_script_format(args.worker_cmd ? args.worker_cmd : args.script);
+        if (args.run_script == NULL) error("Empty run script?");
+        if (args.worker_cmd) workers_start(args.run_script, args.n_thread);
+    }
     
     int n_block = 0;
+    int n_done = 0; // blocks written back
 
     hts_tpool *p = hts_tpool_init(args.n_thread);
     hts_tpool_process *q = hts_tpool_process_init(p, args.n_thread*2, 0);
@@ -330,20 +664,24 @@ int fastq_stream(int argc, char **argv)
                 struct bseq_pool *d = (struct bseq_pool*)hts_tpool_result_data(r);
                 write_out(d);
                 hts_tpool_delete_result(r, 0);
+                n_done++;
             }
         }
         while (block == -1);
     }
-    
-    hts_tpool_process_flush(q);
-    
-    while ((r = hts_tpool_next_result(q))) {
+
+    // hts_tpool_process_flush() of htslib 1.10 may wait forever if the output queue is full when
+    // it is called, so wait for the result of every block instead
+    while (n_done < n_block && (r = hts_tpool_next_result_wait(q))) {
         struct bseq_pool *d = (struct bseq_pool*)hts_tpool_result_data(r);
         write_out(d);
         hts_tpool_delete_result(r, 0);
+        n_done++;
     }
     hts_tpool_process_destroy(q);
     hts_tpool_destroy(p);
+    if (args.worker_cmd) workers_stop();
+    if (args.plugin_fname) plugin_unload();
 
     memory_release();
 
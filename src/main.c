@@ -15,6 +15,7 @@ int usage()
     fprintf(stderr, "    fsort      Sort FASTQ+ records by barcodes.\n");
     fprintf(stderr, "    stream     Perform user-defined process for each read block.\n");
     fprintf(stderr, "    addtags    Add tag string to FASTQ reads.\n");
+    fprintf(stderr, "    wlindex    Compile barcode white list into binary index for parse.\n");
     
     fprintf(stderr, "\n--- Processing BAM\n");
     fprintf(stderr, "    sam2bam    Parse FASTQ+ read name and convert SAM to BAM.\n");
@@ -62,6 +63,7 @@ int main(int argc, char *argv[])
     extern int fastq_parse2(int argc, char **argv);
     extern int fsort(int argc, char **argv);
     extern int fastq_stream(int argc, char **argv);
+    extern int wl_index_main(int argc, char **argv);
     
     // process BAM
     extern int sam2bam(int argc, char *argv[]);
@@ -99,6 +101,7 @@ int main(int argc, char *argv[])
     else if (strcmp(argv[1], "parse") == 0) return fastq_parse2(argc-1, argv+1);    
     else if (strcmp(argv[1], "fsort") == 0) return fsort(argc-1, argv+1);
     else if (strcmp(argv[1], "stream") == 0) return fastq_stream(argc-1, argv+1);
+    else if (strcmp(argv[1], "wlindex") == 0) return wl_index_main(argc-1, argv+1);
     else if (strcmp(argv[1], "sam2bam") == 0) return sam2bam(argc-1, argv+1);
     else if (strcmp(argv[1], "bam2fq") == 0) return bam2fq(argc-1, argv+1);
     else if (strcmp(argv[1], "rmdup") == 0) return bam_rmdup(argc-1, argv+1);
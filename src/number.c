@@ -331,3 +331,14 @@ int human2int(const char *str)
     else if (*q == 'g'||*q=='G') m<<=30;
     return m;
 }
+// same as human2int, for sizes larger than 2G
+long human2long(const char *str)
+{
+    char *q;
+    long m = strtol(str, &q, 0);
+    if (*q == 'k'||*q=='K') m<<=10;
+    else if (*q == 'm'||*q=='M') m<<=20;
+    else if (*q == 'g'||*q=='G') m<<=30;
+    else if (*q == 't'||*q=='T') m<<=40;
+    return m;
+}
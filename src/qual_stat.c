@@ -0,0 +1,103 @@
+#include "qual_stat.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define QUAL_STAT_X86 1
+#endif
+
+#define Q30_CHAR (30+33)
+
+static void qual_stat_scalar(struct qual_stat *st, const char *s, const char *q, int l)
+{
+    uint64_t sum = 0, q30 = 0, n = 0;
+    int i;
+    for (i = 0; i < l; ++i) {
+        sum += (uint8_t)q[i];
+        q30 += (uint8_t)q[i] >= Q30_CHAR;
+        n += (s[i] | 0x20) == 'n';
+    }
+    st->qual_sum += sum - 33*(uint64_t)l;
+    st->q30_bases += q30;
+    st->n_bases += n;
+}
+
+#ifdef QUAL_STAT_X86
+// Quality characters are below 128, so signed compare works. Sum of quality bytes by SAD against 0.
+static void qual_stat_sse2(struct qual_stat *st, const char *s, const char *q, int l)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i q29 = _mm_set1_epi8(Q30_CHAR-1);
+    __m128i lower = _mm_set1_epi8(0x20);
+    __m128i nn = _mm_set1_epi8('n');
+    __m128i sum = zero;
+    uint64_t q30 = 0, n = 0;
+    int i;
+    for (i = 0; i + 16 <= l; i += 16) {
+        __m128i vq = _mm_loadu_si128((const __m128i*)(q+i));
+        __m128i vs = _mm_loadu_si128((const __m128i*)(s+i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(vq, zero));
+        q30 += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(vq, q29)));
+        n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(vs, lower), nn)));
+    }
+    uint64_t t[2];
+    _mm_storeu_si128((__m128i*)t, sum);
+    st->qual_sum += t[0] + t[1] - 33*(uint64_t)i;
+    st->q30_bases += q30;
+    st->n_bases += n;
+    if (i < l) qual_stat_scalar(st, s+i, q+i, l-i);
+}
+
+__attribute__((target("avx2")))
+static void qual_stat_avx2(struct qual_stat *st, const char *s, const char *q, int l)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i q29 = _mm256_set1_epi8(Q30_CHAR-1);
+    __m256i lower = _mm256_set1_epi8(0x20);
+    __m256i nn = _mm256_set1_epi8('n');
+    __m256i sum = zero;
+    uint64_t q30 = 0, n = 0;
+    int i;
+    for (i = 0; i + 32 <= l; i += 32) {
+        __m256i vq = _mm256_loadu_si256((const __m256i*)(q+i));
+        __m256i vs = _mm256_loadu_si256((const __m256i*)(s+i));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(vq, zero));
+        q30 += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(vq, q29)));
+        n += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_or_si256(vs, lower), nn)));
+    }
+    uint64_t t[4];
+    _mm256_storeu_si256((__m256i*)t, sum);
+    st->qual_sum += t[0] + t[1] + t[2] + t[3] - 33*(uint64_t)i;
+    st->q30_bases += q30;
+    st->n_bases += n;
+    if (i < l) qual_stat_sse2(st, s+i, q+i, l-i);
+}
+
+static int has_avx2 = -1;
+#endif
+
+void qual_stat_add(struct qual_stat *st, const char *s, const char *q, int l)
+{
+    if (l <= 0) return;
+    st->bases += l;
+    if (q == NULL) {
+        int i;
+        for (i = 0; i < l; ++i) st->n_bases += (s[i] | 0x20) == 'n';
+        return;
+    }
+#ifdef QUAL_STAT_X86
+    // checked once, racing threads get the same answer
+    if (has_avx2 == -1) has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    if (has_avx2) qual_stat_avx2(st, s, q, l);
+    else qual_stat_sse2(st, s, q, l);
+#else
+    qual_stat_scalar(st, s, q, l);
+#endif
+}
+
+void qual_stat_merge(struct qual_stat *dst, const struct qual_stat *src)
+{
+    dst->bases += src->bases;
+    dst->qual_sum += src->qual_sum;
+    dst->q30_bases += src->q30_bases;
+    dst->n_bases += src->n_bases;
+}
@@ -0,0 +1,20 @@
+// Quality kernels of read segments. Sum of quality, Q30 bases and N bases are counted in one pass,
+// with AVX2 or SSE2 on x86-64 and a scalar loop elsewhere. Quality is Phred+33.
+#ifndef QUAL_STAT_H
+#define QUAL_STAT_H
+
+#include <stdint.h>
+
+struct qual_stat {
+    uint64_t bases;
+    uint64_t qual_sum; // sum of Phred scores, 0 for FASTA
+    uint64_t q30_bases;
+    uint64_t n_bases; // N or n in sequence
+};
+
+// add stats of segment to st, q can be NULL for FASTA
+void qual_stat_add(struct qual_stat *st, const char *s, const char *q, int l);
+
+void qual_stat_merge(struct qual_stat *dst, const struct qual_stat *src);
+
+#endif
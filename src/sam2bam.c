@@ -8,6 +8,8 @@
 #include "htslib/khash.h"
 #include "htslib/kseq.h"
 #include "htslib/bgzf.h"
+#include "htslib/hts_endian.h"
+#include "htslib/hfile.h"
 #include "thread_pool_internal.h"
 #include <zlib.h>
 #include "gtf.h"
@@ -15,7 +17,7 @@
 
 static char *corr_tag = "MM";
 
-KSTREAM_INIT(gzFile, gzread, 16384)
+KSTREAM_INIT(BGZF*, bgzf_read, 16384)
 
 // flag to skip
 #define FLG_USABLE 0
@@ -41,7 +43,7 @@ static struct summary *summary_create()
 
 static struct args {
     // file names
-    const char *input_fname;  // alignment input, only SAM format is required
+    const char *input_fname;  // alignment input, SAM, BAM or CRAM
     const char *output_fname; // BAM output, only support BAM format, default is stdout
     const char *report_fname; // summary report for whole file
 
@@ -49,6 +51,7 @@ static struct args {
     const char *mito_fname; // if set, mitochrondria reads passed QC will be exported in this file
 
     const char *gtf_fname; // gtf is required if -adjust-mapq set
+    const char *ref_fname; // reference fasta to decode CRAM input
 
     int qual_corr;
     int enable_corr;
@@ -57,8 +60,9 @@ static struct args {
     int n_thread;
     int buffer_size;  // buffered records in each chunk
     int file_th;
-    gzFile fp;        // input file handler
+    BGZF *fp;         // SAM input handler, plain or gzipped
     kstream_t *ks;    // input streaming
+    htsFile *fp_in;   // BAM or CRAM input handler, NULL for SAM input
     htsFile *fp_out;     // output file handler
 
     BGZF *fp_mito;    // if not set, mito reads will be treat at filtered reads
@@ -67,6 +71,7 @@ static struct args {
     bam_hdr_t *hdr;   // bam header structure of input
 
     char *preload_record;
+    bam1_t *preload_bam; // first record of next pool for BAM input
 
     struct summary *summary;
 
@@ -77,6 +82,7 @@ static struct args {
     .output_fname      = NULL,
     .report_fname      = NULL,
     .gtf_fname         = NULL,
+    .ref_fname         = NULL,
     .mito              = "chrM",
     .mito_fname        = NULL,
     .qual_corr         = 255,
@@ -87,11 +93,13 @@ static struct args {
     .file_th           = 1,
     .fp                = NULL,
     .ks                = NULL,
+    .fp_in             = NULL,
     .fp_out            = NULL,
     .fp_mito           = NULL,
     .fp_report         = NULL,
     .hdr               = NULL,
     .preload_record    = NULL,
+    .preload_bam       = NULL,
     .summary           = NULL,
     .mito_id           = -2,
     .qual_thres        = 0,
@@ -195,6 +203,55 @@ static struct sam_pool* sam_pool_read(kstream_t *s, int buffer_size)
     
     return p;
 }
+// Compare read names, FASTQ+ tags are not counted
+static int qname_cmp(const char *a, const char *b)
+{
+    for (; *a && *a != '|' && *a == *b; ++a, ++b);
+    if ((*a == '\0' || *a == '|') && (*b == '\0' || *b == '|')) return 0;
+    return 1;
+}
+// Read decoded records from BAM/CRAM, str of records are left NULL
+static struct sam_pool* bam_pool_read(htsFile *fp, bam_hdr_t *h, int buffer_size)
+{
+    struct sam_pool *p = sam_pool_init(buffer_size);
+
+    if (args.preload_bam) {
+        p->bam[p->n++] = args.preload_bam;
+        args.preload_bam = NULL;
+    }
+    int ret;
+    for (;;) {
+        bam1_t *b = bam_init1();
+        if ((ret = sam_read1(fp, h, b)) < 0) {
+            bam_destroy1(b);
+            break;
+        }
+        if (p->n >= buffer_size) { // keep hits of a read in one pool
+            if (qname_cmp(bam_get_qname(b), bam_get_qname(p->bam[p->n-1])) != 0) {
+                args.preload_bam = b;
+                break;
+            }
+            p->str = realloc(p->str, sizeof(void*)*(p->n+1));
+            p->bam = realloc(p->bam, sizeof(void*)*(p->n+1));
+            p->flag = realloc(p->flag, sizeof(int)*(p->n+1));
+        }
+        p->str[p->n] = NULL;
+        p->flag[p->n] = 0;
+        p->bam[p->n++] = b;
+    }
+    if (ret < -1) error("Failed to read %s.", args.input_fname);
+
+    if (p->n == 0) {
+        sam_pool_destroy(p);
+        return NULL;
+    }
+    return p;
+}
+static struct sam_pool *input_pool_read()
+{
+    if (args.fp_in) return bam_pool_read(args.fp_in, args.hdr, args.buffer_size);
+    return sam_pool_read(args.ks, args.buffer_size);
+}
 bam_hdr_t *sam_parse_header(kstream_t *s, kstring_t *line)
 {
     bam_hdr_t *h = NULL;
@@ -337,8 +394,142 @@ int parse_name_str(kstring_t *s)
 
     return 0;
 }
+extern int sam_realloc_bam_data(bam1_t *b, size_t desired);
+// Split FASTQ+ tags "|||XX:T:VAL|||XX:T:VAL" as parse_name_str does, s points to the first '|'
+// of read name. Tags are kept in t one by one, each ends with '\0'.
+static void name_tags_split(const char *s, int l, kstring_t *t)
+{
+    const char *p, *e = s + l, *r = NULL;
+    t->l = 0;
+    for (p = s; p < e; ++p) {
+        if (e - p >= 3 && p[0] == '|' && p[1] == '|' && p[2] == '|') {
+            if (r) {
+                kputsn(r, p - r, t);
+                kputc('\0', t);
+            }
+            p += 3;
+            r = p;
+        }
+    }
+    if (r) {
+        kputsn(r, e - r, t);
+        kputc('\0', t);
+    }
+}
+// Walk tags from name_tags_split. Only A, Z, i and f are accepted here, return -1 for anything
+// else so caller falls back to sam_parse1. Tags are appended to b if not NULL.
+static int name_tags_splice(kstring_t *t, bam1_t *b)
+{
+    char *p, *e = t->s + t->l;
+    for (p = t->s; p < e; p += strlen(p) + 1) {
+        int l = strlen(p) - 5;
+        if (l < 0 || p[0] < '!' || p[1] < '!' || p[2] != ':' || p[4] != ':') return -1;
+        char type = p[3];
+        char *v = p + 5, *end = NULL;
+        uint8_t buf[4];
+        if (type == 'Z') {
+            if (b) bam_aux_append(b, p, 'Z', l+1, (uint8_t*)v);
+        } else if (type == 'A') {
+            if (l != 1) return -1;
+            if (b) bam_aux_append(b, p, 'A', 1, (uint8_t*)v);
+        } else if (type == 'i') {
+            if (l == 0 || (*v != '-' && !isdigit(*v))) return -1;
+            long long x = strtoll(v, &end, 10);
+            if (*end != '\0' || x < INT32_MIN || x > UINT32_MAX) return -1;
+            if (b) {
+                // smallest type, same as sam_parse1
+                if (x < 0) {
+                    if (x >= INT8_MIN) { buf[0] = (int8_t)x; bam_aux_append(b, p, 'c', 1, buf); }
+                    else if (x >= INT16_MIN) { i16_to_le(x, buf); bam_aux_append(b, p, 's', 2, buf); }
+                    else { i32_to_le(x, buf); bam_aux_append(b, p, 'i', 4, buf); }
+                } else {
+                    if (x <= UINT8_MAX) { buf[0] = x; bam_aux_append(b, p, 'C', 1, buf); }
+                    else if (x <= UINT16_MAX) { u16_to_le(x, buf); bam_aux_append(b, p, 'S', 2, buf); }
+                    else { u32_to_le(x, buf); bam_aux_append(b, p, 'I', 4, buf); }
+                }
+            }
+        } else if (type == 'f') {
+            if (l == 0) return -1;
+            double x = strtod(v, &end);
+            if (*end != '\0') return -1;
+            if (b) { float_to_le(x, buf); bam_aux_append(b, p, 'f', 4, buf); }
+        } else return -1;
+    }
+    return 0;
+}
+// Parse any tags from name_tags_split with sam_parse1 on a stub record, so B, H and the other
+// types are encoded as in SAM input. Aux data of the stub is appended to b.
+static int name_tags_parse_aux(kstring_t *t, bam_hdr_t *h, bam1_t *b)
+{
+    kstring_t str = {0,0,0};
+    kputs("*\t4\t*\t0\t0\t*\t*\t0\t0\t*\t*", &str);
+    char *p, *e = t->s + t->l;
+    for (p = t->s; p < e; p += strlen(p) + 1) {
+        kputc('\t', &str);
+        kputs(p, &str);
+    }
+    bam1_t *stub = bam_init1();
+    int ret = sam_parse1(&str, h, stub);
+    if (ret == 0) {
+        uint8_t *aux = bam_get_aux(stub);
+        int l = stub->data + stub->l_data - aux;
+        if (b->l_data + l > b->m_data && sam_realloc_bam_data(b, b->l_data + l) < 0) ret = -1;
+        else {
+            memcpy(b->data + b->l_data, aux, l);
+            b->l_data += l;
+        }
+    }
+    bam_destroy1(stub);
+    free(str.s);
+    return ret;
+}
+// Parse SAM line without copying it. Tags are cut from the read name, name is moved next to the
+// FLAG column so sam_parse1 reads the line in place, then tags are appended to aux. Line is
+// changed after this. tags is a buffer kept by caller.
+static int sam_parse_name_tags(kstring_t *s, bam_hdr_t *h, bam1_t *b, kstring_t *tags)
+{
+    int n, i;
+    for (n = 0; n < s->l && !isspace(s->s[n]); ++n);
+    for (i = 0; i < n && s->s[i] != '|'; ++i);
+    if (i == 0 || i >= n-5) return sam_parse1(s, h, b);
+
+    name_tags_split(s->s+i, n-i, tags);
+    if (name_tags_splice(tags, NULL)) {
+        parse_name_str(s);
+        return sam_parse1(s, h, b);
+    }
+    memmove(s->s+n-i, s->s, i);
+    kstring_t t = { s->l-(n-i), s->m-(n-i), s->s+n-i };
+    int ret = sam_parse1(&t, h, b);
+    if (ret) return ret;
+    return name_tags_splice(tags, b);
+}
+// Move FASTQ+ tags from read name of decoded record to aux, tags are typed the same as SAM input.
+static int bam_name_tags_move(bam1_t *b, bam_hdr_t *h, kstring_t *tags)
+{
+    char *name = bam_get_qname(b);
+    int n = strlen(name), i;
+    for (i = 0; i < n && name[i] != '|'; ++i);
+    if (i == 0 || i >= n-5) return 0;
+
+    name_tags_split(name+i, n-i, tags);
+    int direct = name_tags_splice(tags, NULL) == 0;
+    
+    // shrink name, keep the rest of data aligned as bam_read1 does
+    int l_extranul = (4 - ((i+1) & 3)) & 3;
+    int l_qname = i + 1 + l_extranul;
+    memset(name+i, 0, l_qname - i);
+    memmove(b->data + l_qname, b->data + b->core.l_qname, b->l_data - b->core.l_qname);
+    b->l_data -= b->core.l_qname - l_qname;
+    b->core.l_qname = l_qname;
+    b->core.l_extranul = l_extranul;
+
+    if (direct) return name_tags_splice(tags, b);
+    return name_tags_parse_aux(tags, h, b);
+}
 static void sam_stat_reads(bam1_t *b, struct summary *s, int *flag, struct args *opts)
 {
+    if (b == NULL) return; // failed to parse
     bam1_core_t *c = &b->core;
     if (c->flag & BAM_FSECONDARY) return; // skip secondary alignment
     s->n_reads++;
@@ -378,7 +569,6 @@ static void sam_stat_reads(bam1_t *b, struct summary *s, int *flag, struct args
 }
 extern struct gtf_anno_type *bam_gtf_anno_core(bam1_t *b, struct gtf_spec const *G, bam_hdr_t *h);
 extern void gtf_anno_destroy(struct gtf_anno_type *ann);
-extern int sam_realloc_bam_data(bam1_t *b, size_t desired);
 // return 0 on not correct, 1 on corrected
 static void shrink_bam(bam1_t *bam)
 {
@@ -537,21 +727,31 @@ static void *sam_name_parse(void *_p)
     struct summary *s0 = summary_create();
     bam_hdr_t *h = opts->hdr;
 
+    kstring_t tags = {0,0,0};
     int i;
     for (i = 0; i < p->n; ++i) {
-        parse_name_str(p->str[i]);
+        if (p->str[i] == NULL) { // BAM input
+            if (bam_name_tags_move(p->bam[i], h, &tags)) {
+                warnings("Failed to parse tags, %s", bam_get_qname(p->bam[i]));
+                s0->n_failed_to_parse++;
+                bam_destroy1(p->bam[i]);
+                p->bam[i] = NULL;
+            }
+            continue;
+        }
         if (sam_safe_check(p->str[i])) {
             warnings("Failed to parse %s", p->str[i]->s);
             s0->n_failed_to_parse++;
             p->bam[i] = NULL;
             continue;
         }
-        if (sam_parse1(p->str[i], h, p->bam[i])) {
+        if (sam_parse_name_tags(p->str[i], h, p->bam[i], &tags)) {
             warnings ("Failed to parse SAM., %s", bam_get_qname(p->bam[i]));
             s0->n_failed_to_parse++;
             p->bam[i] = NULL;
         }
     }
+    free(tags.s);
     int n_corr = 0;
     if (args.enable_corr) 
         n_corr = bam_pool_qual_corr(p);
@@ -582,7 +782,7 @@ static void *sam_name_parse(void *_p)
 static int sam_name_parse_light()
 {
     for (;;) {
-        struct sam_pool *p = sam_pool_read(args.ks, args.buffer_size);
+        struct sam_pool *p = input_pool_read();
         if (p == NULL) break;
         p->opts = &args;
         p = sam_name_parse(p);
@@ -615,6 +815,7 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(a, "-report") == 0) var = &args.report_fname;
         else if (strcmp(a, "-@") == 0) var = &file_th;
         else if (strcmp(a, "-gtf") == 0) var = &args.gtf_fname;
+        else if (strcmp(a, "-T") == 0) var = &args.ref_fname;
         else if (strcmp(a, "-qual") == 0) var = &qual_corr;
         else if (strcmp(a, "-q") == 0) var = &qual_thres;
         else if (strcmp(a, "-k") == 0) { // -k has been removed, 2020/02/13
@@ -647,9 +848,21 @@ static int parse_args(int argc, char **argv)
     if (args.input_fname == NULL && !isatty(fileno(stdin))) args.input_fname = "-";
     if (args.input_fname == NULL) error("No input SAM file is set!");
     if (args.output_fname == NULL) error("No output BAM file specified.");
-    args.fp = strcmp(args.input_fname, "-") ? gzopen(args.input_fname, "r") : gzdopen(fileno(stdin), "r");
-    if (args.fp == NULL) error("%s : %s.", args.input_fname, strerror(errno));
-    args.ks = ks_init(args.fp);
+    hFILE *hfp = hopen(args.input_fname, "r");
+    if (hfp == NULL) error("%s : %s.", args.input_fname, strerror(errno));
+    htsFormat fmt;
+    if (hts_detect_format(hfp, &fmt)) error("Failed to detect format of %s.", args.input_fname);
+    if (fmt.format == bam || fmt.format == cram) {
+        args.fp_in = hts_hopen(hfp, args.input_fname, "r");
+        if (args.fp_in == NULL) error("Failed to open %s.", args.input_fname);
+        if (fmt.format == cram && args.ref_fname && hts_set_fai_filename(args.fp_in, args.ref_fname))
+            error("Failed to load reference %s.", args.ref_fname);
+    }
+    else {
+        args.fp = bgzf_hopen(hfp, "r");
+        if (args.fp == NULL) error("%s : %s.", args.input_fname, strerror(errno));
+        args.ks = ks_init(args.fp);
+    }
 
     // init output    
     args.fp_out = hts_open(args.output_fname, "bw");
@@ -659,6 +872,7 @@ static int parse_args(int argc, char **argv)
         args.file_th = str2int((char*)file_th);
         if (args.file_th <1) args.file_th = 1;
         hts_set_threads(args.fp_out, args.file_th);
+        if (args.fp_in) hts_set_threads(args.fp_in, args.file_th);
     }
     // set compress level from 6 to 0, save ~1x runtime, but will also increase ~0.5x file size
     if (args.fp_out->is_bgzf)
@@ -699,7 +913,8 @@ static int parse_args(int argc, char **argv)
     
     // init bam header and first bam record
     kstring_t str = {0,0,0}; // cache first record
-    args.hdr = sam_parse_header(args.ks, &str);
+    if (args.fp_in) args.hdr = sam_hdr_read(args.fp_in);
+    else args.hdr = sam_parse_header(args.ks, &str);
     if (args.hdr == NULL) error("Failed to parse header. %s", args.input_fname);
     if (sam_hdr_write(args.fp_out, args.hdr)) error("Failed to write header.");
     if (args.fp_mito && bam_hdr_write(args.fp_mito, args.hdr)) error("Failed to write header.");
@@ -712,7 +927,7 @@ static int parse_args(int argc, char **argv)
     }
 
     // check if there is a BAM record
-    if (str.s[0] != '@')
+    if (str.l && str.s[0] != '@')
         args.preload_record = strndup(str.s, str.l);    
     free(str.s);
     return 0;
@@ -721,8 +936,11 @@ static int parse_args(int argc, char **argv)
 static void memory_release()
 {
     hts_close(args.fp_out);
-    ks_destroy(args.ks);
-    gzclose(args.fp);
+    if (args.fp_in) hts_close(args.fp_in);
+    else {
+        ks_destroy(args.ks);
+        bgzf_close(args.fp);
+    }
     bam_hdr_destroy(args.hdr);
     free(args.summary);    
     if (args.fp_mito) bgzf_close(args.fp_mito);
@@ -750,7 +968,7 @@ int sam2bam(int argc, char **argv)
 
         for (;;) {
 
-            struct sam_pool *b = sam_pool_read(args.ks, args.buffer_size);
+            struct sam_pool *b = input_pool_read();
             if (b == NULL) break;
             b->opts = &args;
 
@@ -3,329 +3,323 @@
 #include "htslib/kstring.h"
 #include "sim_search.h"
 
-#define BASE_TERM 0x0
-#define BASE_A  0x1
-#define BASE_C  0x2
-#define BASE_G  0x3
-#define BASE_T  0x4
-#define BASE_N  0x5
+/*
+  Sequences are packed in 2 bits per base, so a fixed length sequence up to 32 bp is one uint64_t.
 
-//static int kmer_min = 5;
-static int kmer_max = 21;
+  Candidates are found by pigeonhole: the first L-e bases of each sequence are split into e+1 parts,
+  a sequence within e errors of the query keeps at least one part unchanged, shifted by at most e
+  bases if indels are allowed. Each part is indexed in an array of sequences sorted by part key.
+  The first L-e bases are used, so trailing bases pushed out of the query window by insertions
+  do not break the index.
 
-static int kmer_size = 5;
-
-typedef struct ss_idx {
-    int *idx;
-    int n,m;
-} sidx_t;
+  Candidates are verified in the packed form, hamming distance by xor and popcount of the 2-bit
+  fields, edit distance by the bit-vector algorithm of Myers after a lower bound filter.
+ */
 
 KHASH_MAP_INIT_INT64(ss64, int)
-KHASH_MAP_INIT_INT(ss32, sidx_t)
 
 typedef kh_ss64_t hash64_t;
-typedef kh_ss32_t hash32_t;
+
+#define SS_MAX_LEN 32
+#define SS_MAX_DIST 3
+
+// sequence is copied into the part index, so candidates of one key are scanned in sequential memory
+struct ss_ent {
+    uint64_t s;
+    uint32_t idx;
+    uint32_t key; // part key
+};
 
 struct similarity_search_aux {
-    hash64_t *d0;
-    hash32_t *d1; 
-    uint64_t *cs; // compact sequence    
+    int len; // all sequences should be the same length
+    hash64_t *d0; // exact index
+    uint64_t *cs; // compact sequences
     int n, m;
+
+    int e; // max distance the part index is built for
+    int np; // e+1 parts
+    int st[SS_MAX_DIST+1];
+    int ed[SS_MAX_DIST+1];
+    struct ss_ent *parts[SS_MAX_DIST+1]; // sorted by part key
 };
 
-uint8_t encode_base(char c)
-{
-    switch (c) {
-        case 'A':
-        case 'a':
-            return BASE_A;
-        case 'C':
-        case 'c':
-            return BASE_C;
-        case 'G':
-        case 'g':
-            return BASE_G;
-        case 'T':
-        case 't':
-            return BASE_T;
-        case 'N':
-        case 'n':
-            return BASE_N;
-        case '\0':
-            return 0x0;
-        default:
-            error("Try to encode a non DNA sequence ? %c", c);
-    }
-}
-// not safe for Ns
-uint32_t enc32(char *s, int l)
-{
-    int len = strlen(s);
-    if (len < l) error("Try to encode a truncated sequence ?");
-    if (len > 16) error("Only support to encode sequence shorter than 16nt.");
-    uint64_t q = 0;
-    int i;
-    for (i = 0; i < l; ++i)
-        q = q<<3 | (encode_base(s[i]) & 0x7);
-    return q;
+static const uint8_t ss_nt4_table[256] = {
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 0, 4, 1,  4, 4, 4, 2,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  3, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 0, 4, 1,  4, 4, 4, 2,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  3, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,
+    4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4
+};
 
-}
-// not safe for Ns
-uint64_t enc64(char *s)
-{
-    int l = strlen(s);
-    if (l > 32) error("Only support to encode sequence not longer than 32nt.");
-    uint32_t q = 0;
-    int i;
-    for (i = 0; i < l; ++i)
-        q = q<<3 | (encode_base(s[i]) & 0x7);
-    return q;
-}
+// packed query, N bases are stored as A and marked in nmask, one bit per base at the low bit of 2-bit field
+struct ss_query {
+    uint64_t q;
+    uint64_t nmask;
+    int n_N;
+    uint64_t peq[4]; // match vectors of each base, bit i for base i
+};
 
-char *decode64(uint64_t q)
+static void ss_pack(const char *s, int l, struct ss_query *Q)
 {
-    char c[23];
-    memset(c, 0, 23);
-    int i = 21;
-    for (;;) {
-        uint8_t x = q & 0x7;
-        if (x == 0x1) c[i] = 'A'; // kputc('A', &str);
-        else if (x == 0x2) c[i] = 'C'; // kputc('C', &str);
-        else if (x == 0x3) c[i] = 'G'; // kputc('G', &str);
-        else if (x == 0x4) c[i] = 'T'; // kputc('T', &str);
-        else if (x == 0x5) c[i] = 'N';
-        else break;
-        i--;
-        q = q>>3;
+    int i;
+    Q->q = 0;
+    Q->nmask = 0;
+    Q->n_N = 0;
+    memset(Q->peq, 0, sizeof(Q->peq));
+    for (i = 0; i < l; ++i) {
+        uint8_t c = ss_nt4_table[(uint8_t)s[i]];
+        if (c < 4) Q->peq[c] |= 1ULL << i;
+        Q->nmask <<= 2;
+        if (c > 3) {
+            Q->nmask |= 1;
+            Q->n_N++;
+            c = 0;
+        }
+        Q->q = Q->q<<2 | c;
     }
-    kstring_t str = {0,0,0};
-    kputs(c+i+1, &str);
-    return str.s;
 }
-char *decode32(uint32_t q)
+static inline uint64_t ss_lmask(int l)
 {
-    char c[11];
-    memset(c, 0, 11);
-    int i = 9;
-    for (;;) {
-        uint8_t x = q & 0x7;
-        if (x == 0x1) c[i] = 'A'; // kputc('A', &str);
-        else if (x == 0x2) c[i] = 'C'; //kputc('C', &str);
-        else if (x == 0x3) c[i] = 'G'; //kputc('G', &str);
-        else if (x == 0x4) c[i] = 'T'; //kputc('T', &str);
-        else if (x == 0x5) c[i] = 'N';
-        else break;
-        i--;
-        q = q>>3;
-    }
-    kstring_t str = {0,0,0};
-    kputs(c+i+1, &str);
-    return str.s;
+    return l >= 32 ? ~0ULL : (1ULL << (l<<1)) - 1;
 }
-static int check_Ns(char *s, int l)
+static inline uint64_t ss_sub(uint64_t q, int len, int st, int ed)
 {
-    if (l == 0) l = strlen(s);
-    int i;
-    for (i = 0; i < l; ++i)
-        if (s[i] != 'A' && s[i] != 'a' && s[i] != 'C' && s[i] != 'c'
-            && s[i] != 'G' && s[i] != 'g' && s[i] != 'T' && s[i] != 't') return 1;
-
-    return 0;
+    return (q >> ((len - ed)<<1)) & ss_lmask(ed - st);
 }
 
-void ss_print(ss_t *S)
-{
-    printf("Printing struct SS..\n");
-    khint_t k;
-    for (k = 0; k != kh_end(S->d0); ++k) {
-        if (kh_exist(S->d0, k)) {
-            int key = kh_key(S->d0, k);
-            char *s = decode64(key);
-            printf("%s\n", s);
-            free(s);
-        }       
-    }
-    for (k = 0; k != kh_end(S->d1); ++k) {
-        if (kh_exist(S->d1, k)) {
-            int key = kh_key(S->d1, k);
-            char *s = decode64(key);
-            printf("%s\n", s);
-            free(s);
-            sidx_t *idx = &kh_val(S->d1, k);
-            int i;
-            for (i = 0; i < idx->n; ++i)
-                printf("%d ", idx->idx[i]);
-            printf("\n");
-        }
-    }
-}
 ss_t *ss_init()
 {
     ss_t *s = malloc(sizeof(*s));
     memset(s, 0, sizeof(ss_t));
     s->d0 = kh_init(ss64);
-    s->d1 = kh_init(ss32);
     return s;
 }
 
 void ss_destroy(ss_t *S)
 {
     kh_destroy(ss64, S->d0);
-    khint_t k;
-    for (k = kh_begin(S->d1); k != kh_end(S->d1); ++k) {
-        if (kh_exist(S->d1, k)) {
-            sidx_t *idx = &kh_val(S->d1, k);
-            if (idx &&idx->idx) free(idx->idx);
-        }
-    }
-    kh_destroy(ss32, S->d1);
+    int i;
+    for (i = 0; i < S->np; ++i) free(S->parts[i]);
     free(S->cs);
     free(S);
 }
 
-static void build_kmers(ss_t *S, uint64_t q, int idx)
-{
-    int offset = 3 *kmer_size;
-    uint32_t mask = ~(0x1<<offset);
-    mask = mask<<(32-offset)>>(32-offset);
-    for (;;) {
-        if (q>>(offset-3) == 0) break;
-        uint32_t x = q & mask;
-        q=q>>3;
-        khint_t k = kh_get(ss32, S->d1, x);
-        if (k != kh_end(S->d1)) {
-            struct ss_idx *si = &kh_val(S->d1, k);
-            if (si->m == si->n) {
-                si->m = si->m<<1;
-                si->idx = realloc(si->idx, si->m*sizeof(int));
-            }
-            si->idx[si->n++] = idx;
-        }
-        else {
-            int ret;
-            k = kh_put(ss32, S->d1, x, &ret);
-            struct ss_idx *si = &kh_val(S->d1, k);
-            memset(si, 0, sizeof(struct ss_idx));
-            si->m = 2;
-            si->idx = realloc(si->idx, sizeof(int)*si->m);
-            si->idx[si->n++] = idx;
-        }
-    }
-}
 int ss_push(ss_t *S, char *seq)
 {
-    int N = check_Ns(seq, 0);
-    if (N) error("Try to push sequence %s contain Ns.", seq);
-    uint64_t q = enc64(seq);
-    khint_t k = kh_get(ss64, S->d0, q);
+    int l = strlen(seq);
+    if (l == 0 || l > SS_MAX_LEN) error("Only support to encode sequence not longer than %dnt. %s", SS_MAX_LEN, seq);
+    if (S->len == 0) S->len = l;
+    if (l != S->len) error("Inconsistance sequence length. %d vs %d, %s", S->len, l, seq);
+
+    struct ss_query Q;
+    ss_pack(seq, l, &Q);
+    if (Q.n_N) error("Try to push sequence %s contain Ns.", seq);
+
+    khint_t k = kh_get(ss64, S->d0, Q.q);
     if (k != kh_end(S->d0)) return 1;
     if (S->n == S->m) {
         S->m = S->m == 0 ? 1024 : S->m<<1;
         S->cs = realloc(S->cs, S->m*sizeof(uint64_t));
     }
-    S->cs[S->n] = q;
+    S->cs[S->n] = Q.q;
     int ret;
-    k = kh_put(ss64, S->d0, S->cs[S->n], &ret);
+    k = kh_put(ss64, S->d0, Q.q, &ret);
     kh_val(S->d0, k) = S->n;
-    build_kmers(S, q, S->n);
-
     S->n++;
     return 0;
 }
 
-struct element {
-    int ele;
-    int cnt;
-};
-typedef struct set {
-    struct element *ele;
-    int n, m;
-} set_t;
-
-set_t *set_init()
+static int cmp_ent(const void *a, const void *b)
 {
-    set_t *set = malloc(sizeof(*set));
-    memset(set, 0, sizeof(*set));
-    return set;
+    const struct ss_ent *x = (const struct ss_ent*)a;
+    const struct ss_ent *y = (const struct ss_ent*)b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
 }
-void set_destory(set_t *set)
+int ss_build(ss_t *S, int e)
 {
-    if (set->m) free(set->ele);
-    free(set);
-}
-static void set_push_core(int ele, set_t *set)
-{
-    int i;
-    for (i = 0; i < set->n; ++i)
-        if (set->ele[i].ele == ele) {
-            set->ele[i].cnt++;
-            return;
+    int i, j;
+    for (i = 0; i < S->np; ++i) free(S->parts[i]);
+    S->np = 0;
+    S->e = e;
+    if (e <= 0 || S->n == 0) return 0;
+    if (e > SS_MAX_DIST) error("Allow %d distance at max.", SS_MAX_DIST);
+
+    int r = S->len - e; // bases could be aligned in the query window
+    if (r < e+1) error("Barcode is too short to correct %d errors.", e);
+
+    S->np = e+1;
+    for (i = 0; i < S->np; ++i) {
+        S->st[i] = i*r/S->np;
+        S->ed[i] = (i+1)*r/S->np;
+        struct ss_ent *p = malloc(S->n*sizeof(struct ss_ent));
+        for (j = 0; j < S->n; ++j) {
+            p[j].s = S->cs[j];
+            p[j].idx = j;
+            p[j].key = ss_sub(S->cs[j], S->len, S->st[i], S->ed[i]);
         }
-
-    if (set->n == set->m) {
-        set->m = set->m == 0 ? 2 : set->m<<1;
-        set->ele = realloc(set->ele, sizeof(struct element)*set->m);
+        qsort(p, S->n, sizeof(struct ss_ent), cmp_ent);
+        S->parts[i] = p;
     }
-    
-    set->ele[set->n].ele = ele;
-    set->ele[set->n].cnt = 1;
-    set->n++;
+    return 0;
 }
-void set_push(int *ele, int n, set_t *set)
-{
-    assert(n > 0);
 
-    int i;
-    for (i = 0; i < n; ++i) set_push_core(ele[i], set);    
-}
-int cmpfunc (const void * a, const void * b)
+// hamming distance of 2-bit packed sequences, N in query counts as mismatch
+static inline int ss_hamming(uint64_t a, const struct ss_query *Q, int len)
 {
-    return (*(struct element*)b).cnt - (*(struct element*)a).cnt;
+    uint64_t x = a ^ Q->q;
+    x = (x | x >> 1) & 0x5555555555555555ULL & ss_lmask(len);
+    return __builtin_popcountll(x | Q->nmask);
 }
 
-int set_top_2(set_t *set)
+// edit distance by bit-vector algorithm of Myers, query is the pattern and a is the text. The query window
+// is fixed length, trailing bases of either sequence could be left unaligned up to e bases.
+static int ss_edit(uint64_t a, const struct ss_query *Q, int len, int e)
 {
-    if (set->n <= 2) return set->n;
-
-    qsort(set->ele, set->n,  sizeof(struct element),  cmpfunc);
-
-    int max = set->ele[1].cnt;
+    uint64_t mask = len >= 64 ? ~0ULL : (1ULL << len) - 1;
+    uint64_t high = 1ULL << (len - 1);
+    uint64_t VP = mask, VN = 0;
+    int score = len; // last row
+    int best = e+1;
     int i;
-    for (i = 2; max <= set->ele[i].cnt && i < set->n; ++i) {}
-    return i;
+    for (i = 0; i < len; ++i) {
+        uint64_t Eq = Q->peq[(a >> ((len - 1 - i)<<1)) & 3];
+        uint64_t Xv = Eq | VN;
+        uint64_t Xh = (((Eq & VP) + VP) ^ VP) | Eq;
+        uint64_t HP = VN | ~(Xh | VP);
+        uint64_t HN = VP & Xh;
+        if (HP & high) score++;
+        else if (HN & high) score--;
+        HP = HP << 1 | 1; // first row is i+1
+        HN = HN << 1;
+        VP = (HN | ~(Xv | HP)) & mask;
+        VN = HP & Xv & mask;
+        if (i + 1 >= len - e && score < best) best = score; // trailing bases of a unaligned
+    }
+    // last column, trailing bases of query unaligned
+    int j;
+    for (j = len - e; j < len; ++j) {
+        if (j < 0) continue;
+        uint64_t low = (1ULL << j) - 1;
+        int d = len + __builtin_popcountll(VP & low) - __builtin_popcountll(VN & low);
+        if (d < best) best = d;
+    }
+    return best;
 }
 
-int hamming_dist_calc(uint64_t a, uint64_t b)
+// lower bound of edit distance: bases of a not equal to any query base within e positions must be
+// substituted or deleted. All shifts are compared at once on the packed sequences.
+static inline int ss_edit_lb(uint64_t a, const struct ss_query *Q, int len, int e)
 {
-    char *s1 = decode64(a);
-    char *s2 = decode64(b);
-    int l = strlen(s1);
-    int i;
-    int d = 0;
-    for (i = 0; i < l; ++i)
-        if (s1[i] != s2[i]) d++;
-    free(s1); free(s2);
-    return d;
+    uint64_t lmask = ss_lmask(len);
+    uint64_t miss = 0x5555555555555555ULL & lmask;
+    int s;
+    for (s = -e; s <= e; ++s) {
+        uint64_t q, n, valid;
+        if (s >= 0) { // a[i] vs q[i+s]
+            q = (Q->q << (s<<1)) & lmask;
+            n = (Q->nmask << (s<<1)) & lmask;
+            valid = lmask & ~ss_lmask(s);
+        } else {
+            q = Q->q >> (-s<<1);
+            n = Q->nmask >> (-s<<1);
+            valid = ss_lmask(len + s) ;
+        }
+        uint64_t x = a ^ q;
+        x = ((x | x >> 1) & 0x5555555555555555ULL) | n | (~valid & 0x5555555555555555ULL);
+        miss &= x;
+    }
+    // the last e bases of a could be left unaligned
+    miss &= ~ss_lmask(e);
+    return __builtin_popcountll(miss);
 }
 
-extern size_t levenshtein_n(const char *a, const size_t length, const char *b, const size_t bLength);
+static inline void ss_check(ss_t *S, const struct ss_query *Q, const struct ss_ent *c, int e, int indel, int *best, int *hit, int *hit2)
+{
+    int idx = c->idx;
+    if (idx == *hit || idx == *hit2) return;
+    int d;
+    if (indel) {
+        if (ss_edit_lb(c->s, Q, S->len, e) > e) return;
+        d = ss_edit(c->s, Q, S->len, e);
+    }
+    else d = ss_hamming(c->s, Q, S->len);
+    if (d > e || d > *best) return;
+    if (d < *best) {
+        *best = d;
+        *hit = idx;
+        *hit2 = -1;
+    } else {
+        *hit2 = idx; // same distance with a different sequence
+    }
+}
 
-int levnshn_dist_calc(uint64_t a, uint64_t b)
+int ss_query2(ss_t *S, const char *seq, int l, int e, int indel, int *dist)
 {
-    char *s1 = decode64(a);
-    char *s2 = decode64(b);
-    int l = strlen(s1);
-    int dist = levenshtein_n(s1, l, s2, l);
-    free(s1);
-    free(s2);
-    return dist;
+    *dist = 0;
+    if (l != S->len) return -1;
+    struct ss_query Q;
+    ss_pack(seq, l, &Q);
+    if (Q.n_N == 0) {
+        khint_t k = kh_get(ss64, S->d0, Q.q);
+        if (k != kh_end(S->d0)) return kh_val(S->d0, k);
+    }
+    if (e == 0 || Q.n_N > e) return -1;
+    if (e > S->e) error("Index is built for %d distance, but %d is required.", S->e, e);
+
+    int best = e+1, hit = -1, hit2 = -1;
+    int shift = indel ? e : 0;
+    int i, d;
+    for (i = 0; i < S->np; ++i) {
+        for (d = -shift; d <= shift; ++d) {
+            int st = S->st[i] + d;
+            int ed = S->ed[i] + d;
+            if (st < 0 || ed > l) continue;
+            if (ss_sub(Q.nmask, l, st, ed)) continue; // N in this part
+            uint32_t key = ss_sub(Q.q, l, st, ed);
+            struct ss_ent *p = S->parts[i];
+            // lower bound
+            int lo = 0, hi = S->n;
+            while (lo < hi) {
+                int mid = (lo + hi) >> 1;
+                if (p[mid].key < key) lo = mid + 1;
+                else hi = mid;
+            }
+            for (; lo < S->n && p[lo].key == key; ++lo)
+                ss_check(S, &Q, &p[lo], e, indel, &best, &hit, &hit2);
+        }
+    }
+    if (hit == -1 || hit2 != -1) return -1;
+    *dist = best;
+    return hit;
 }
 
-// static int use_levenshtein_distance = 0;
+int ss_decode(ss_t *S, int idx, char *out)
+{
+    static const char nt[4] = { 'A', 'C', 'G', 'T' };
+    uint64_t q = S->cs[idx];
+    int i;
+    for (i = S->len - 1; i >= 0; --i) {
+        out[i] = nt[q & 3];
+        q >>= 2;
+    }
+    return S->len;
+}
 
 // 1 for hamming distance
 // 2 for levenshtein distance
-// 3 for mixed 
+// 3 for mixed
 static int dist_method = 1;
 
 void set_method(int i)
@@ -335,12 +329,10 @@ void set_method(int i)
 void set_hamming()
 {
     set_method(1);
-    //use_levenshtein_distance = 0;
 }
 void set_levenshtein()
 {
     set_method(2);
-    //use_levenshtein_distance = 1;    
 }
 void set_mix()
 {
@@ -348,90 +340,30 @@ void set_mix()
 }
 char *ss_query(ss_t *S, char *seq, int e, int *exact)
 {
-    *exact = 1; // exactly match
-    int l = strlen(seq);
-    if (l > kmer_max) error("Sequence is too long. %s", seq);
-    uint64_t q = enc64(seq);
-    khint_t k = kh_get(ss64, S->d0, q);
-    
-    if (k != kh_end(S->d0)) return decode64(q); // exactly match
-
     *exact = 0;
-    int i;
-    set_t *set = set_init();
-    
-    for (i = 0; i < l - kmer_size+1; ++i) {
-        int j = check_Ns(seq+i, kmer_size);
-        if (j) {
-            i+=j;
-            continue;
-        }
-        uint32_t q0 = enc32(seq+i, kmer_size);
-         k = kh_get(ss32, S->d1, q0);        
-        if (k == kh_end(S->d1)) continue;
-        
-        struct ss_idx *idx = &kh_val(S->d1, k);        
-        set_push(idx->idx, idx->n, set);        
-    }
-
-
-    /*
-      Previous we use kmer frequency to identify the similar of two sequence and calculate the lenvenstain distance
-      for top 2 candidates. However, in some cases, when a sequence error happens at the middle of query sequence, leading
-      to low frequency of kmers, will be ignored at this step. So we now will count all candidates. 
-
-      // int n = set_top_2(set);      
-
-      */
-
-    
-    int hit = -1;
-    for (i = 0; i < set->n; ++i) {
-        int dist = 0;
-        if (dist_method == 1) {
-            dist = hamming_dist_calc(S->cs[set->ele[i].ele], q);
-        } else if (dist_method == 2) {
-            dist = levnshn_dist_calc(S->cs[set->ele[i].ele], q);
-        } else if (dist_method == 3) {
-            dist = hamming_dist_calc(S->cs[set->ele[i].ele], q);
-        } else {
-            error("Unknown dist method.");
-        }
+    int l = strlen(seq);
+    int dist;
+    int idx = ss_query2(S, seq, l, e, dist_method == 2, &dist);
 
-        if (dist <= e) {
-            if (hit != -1) goto multi_hits;
-            hit = set->ele[i].ele;
-        }
-    }
     // mix method, if hamming dist not work, use levenshtein instead. Wang Zhifeng report there are ~5% reads offset
     // 1 position in ad153 library, 20220223
-    if (hit == -1 && dist_method == 3) {
-        for (i = 0; i < set->n; ++i) {
-            int dist;
-            dist = levnshn_dist_calc(S->cs[set->ele[i].ele], q);
-            if (dist <= e) {
-                if (hit != -1) goto multi_hits;
-                hit = set->ele[i].ele;
-            }
-        }
-    }
-    
-    set_destory(set);
+    if (idx == -1 && dist_method == 3) idx = ss_query2(S, seq, l, e, 1, &dist);
+    if (idx == -1) return NULL;
 
-    if (hit == -1) return NULL;
-    return decode64(S->cs[hit]);
-
-  multi_hits:
-    set_destory(set);
-    return NULL;
+    *exact = dist == 0;
+    char *s = malloc(S->len+1);
+    ss_decode(S, idx, s);
+    s[S->len] = '\0';
+    return s;
 }
 
 #ifdef SS_MAIN
 int main()
 {
-    ss_t *S = ss_init();    
+    ss_t *S = ss_init();
     ss_push(S,"CGATCGTCAG");
     // ss_push(S,"ACTTCTATGC");
+    ss_build(S, 2);
 
     set_levenshtein();
     int exact;
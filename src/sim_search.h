@@ -14,6 +14,11 @@ extern void set_mix();
 extern ss_t *ss_init();
 extern char *ss_query(ss_t *S, char *seq, int e, int *i);
 extern int ss_push(ss_t *S, char *seq);
+// build candidate index for up to e errors, call after all sequences pushed
+extern int ss_build(ss_t *S, int e);
+// return index of the unique best hit within e errors, -1 on not found or multi hits
+extern int ss_query2(ss_t *S, const char *seq, int l, int e, int indel, int *dist);
+extern int ss_decode(ss_t *S, int idx, char *out);
 extern void ss_destroy(ss_t *);
 
 #endif
@@ -0,0 +1,26 @@
+// Plugin interface of PISA stream. A plugin is a shared object loaded by stream -plugin, which
+// exports the functions below. Blocks are passed in memory, no script or temp file is involved.
+//
+//   int init(const char *arg);
+//       Called once before reading, arg is the string of -plugin-arg or NULL. Return 0 on success.
+//
+//   int process_block(struct bseq_pool *in, struct bseq_pool *out);
+//       Called on worker threads for each block, so it should be thread safe. in->opts keeps tag
+//       values of this block. Output records are added to the empty pool out by bseq_pool_push()
+//       or bseq_pool_next(), and renamed with tags of block by stream. Return 0 on success.
+//
+//   void finish();
+//       Called once after all blocks are processed.
+//
+// Functions of PISA, such as bseq_pool_dedup(), are exported to plugins. Build plugins with
+//   gcc -fPIC -shared -Isrc -Ithird_party/htslib-1.10.2 plugin.c -o plugin.so
+#ifndef STREAM_PLUGIN_H
+#define STREAM_PLUGIN_H
+
+#include "fastq.h"
+
+typedef int (*stream_plugin_init_func)(const char *arg);
+typedef int (*stream_plugin_process_func)(struct bseq_pool *in, struct bseq_pool *out);
+typedef void (*stream_plugin_finish_func)();
+
+#endif
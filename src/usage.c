@@ -75,13 +75,17 @@ int fastq_parse2_usage()
     fprintf(stderr, "\x1b[36m\x1b[1m$\x1b[0m \x1b[1mPISA\x1b[0m parse -rule CB,R1:1-10,whitelist.txt,CB,1;R1,R1:11-60;R2,R2 -report fastq.csv \\\n");
     fprintf(stderr, "           lane1_1.fq.gz,lane02_1.fq.gz  lane1_2.fq.gz,lane2_2.fq.gz\n");
     fprintf(stderr, "\nOptions :\n");
-    fprintf(stderr, " -1       [fastq]   Read 1 output.\n");
-    fprintf(stderr, " -2       [fastq]   Read 2 output.\n");
+    fprintf(stderr, " -1       [fastq]   Read 1 output. BGZF compressed if file name ends with .gz. Unaligned BAM if ends with .bam.\n");
+    fprintf(stderr, " -2       [fastq]   Read 2 output. BGZF compressed if file name ends with .gz.\n");
     fprintf(stderr, " -rule    [STRING]  Read structure in line. See \x1b[31m\x1b[1mNotice\x1b[0m.\n");
     fprintf(stderr, " -p                 Read 1 and read 2 interleaved in the input file.\n");
-    fprintf(stderr, " -q       [INT]     Drop reads if average sequencing quality below this value.\n");
+    fprintf(stderr, " -q       [INT]     Drop reads if average sequencing quality of output read 1 or read 2 below this value.\n");
     fprintf(stderr, " -dropN             Drop reads if N base in sequence or barcode.\n");
-    fprintf(stderr, " -report  [csv]     Summary report.\n");
+    fprintf(stderr, " -report  [csv]     Summary report, with Q30 ratio of each tag and reads.\n");
+    fprintf(stderr, " -cbdis   [FILE]    Read count per cell barcode, sorted by count.\n");
+    fprintf(stderr, " -cbdis-top [INT]   Only keep top barcodes for -cbdis in bounded memory, counts are estimated.\n");
+    fprintf(stderr, " -shards  [INT]     Split output by cell barcode, shard number is added to file names of -1 and -2.\n");
+    fprintf(stderr, " -cb-tag  [TAG]     Cell barcode tag for -cbdis and -shards. Default is the tag corrected by white list.\n");
     fprintf(stderr, " -order             Keep input order.\n");
     fprintf(stderr, " -t       [INT]     Threads. [4]\n");
     //fprintf(stderr, " -suffix  [STRING]  Suffix string for corrected barcode.\n");
@@ -97,7 +101,20 @@ int fastq_parse2_usage()
     fprintf(stderr, "   TAG and location parts are mandatory, and whitelist, corrected TAG and mismatch are optional.\n");
     fprintf(stderr, "   Futhermore, multiply tags separated by \';\'. In location part, R1 stands for raw read 1, R2 stands for raw read 2.\n");
     fprintf(stderr, "   In tag part, R1 stands for output read 1 while R2 stands for output read 2. Here are some examples.\n");
-    fprintf(stderr, " * PISA/parse read FASTQ files by using libz APIs which is not work in parallel, increase the number of threads.\n");
+    fprintf(stderr, " * Allow mismatch part is the max distance to whitelist, 0-3. Add \'i\' to allow indels, such as 1i or 2i.\n");
+    fprintf(stderr, "   Corrected barcode should be the unique best hit. More than one mismatch or indels require fixed length ACGT barcodes.\n");
+    fprintf(stderr, " * Whitelist can be a text file or a binary index compiled by `PISA wlindex`, which loads instantly.\n");
+    fprintf(stderr, " * Add \"sample\" after allow mismatch part to demultiplex samples by this tag, such as SR,R1:1-8,samples.txt,SB,1,sample.\n");
+    fprintf(stderr, "   Reads of each barcode in the whitelist are written to their own files, named like out_ACGTACGT.fq.gz for -1 out.fq.gz,\n");
+    fprintf(stderr, "   unmatched reads are written to out_undetermined.fq.gz. Only one sample tag is allowed, and -1 is required.\n");
+    fprintf(stderr, " * Each input FASTQ is decompressed by its own thread. BGZF compressed inputs are decompressed in parallel with -t threads.\n");
+    fprintf(stderr, " * With -shards, reads are assigned by hash of cell barcode, corrected barcode is used if corrected.\n");
+    fprintf(stderr, "   All reads of a cell are in the same shard, such as out_0.fq.gz, out_1.fq.gz for -1 out.fq.gz.\n");
+    fprintf(stderr, " * Unaligned BAM output keeps both reads in one file, tags are written as aux fields instead of read name.\n");
+    fprintf(stderr, " * -cbdis counts cell barcode, corrected barcode is used if corrected. Knee of the barcode rank\n");
+    fprintf(stderr, "   curve is reported as estimated number of cells.\n");
+    fprintf(stderr, " * Cell barcode of -cbdis and -shards is the only tag corrected by white list except sample tag, or set by -cb-tag.\n");
+    fprintf(stderr, " * Reading, barcode parsing and writing run as pipeline stages, busy time of each stage is logged at exit.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "\x1b[36m\x1b[1m$\x1b[0m \x1b[1mPISA\x1b[0m parse -rule '\x1b[32mCR,R1:1-18,barcodes.txt,CB,1;\x1b[33mUR,R1:19-30;\x1b[34mR1,R2:1-100\x1b[0m' -1 read_1.fq raw_read_1.fq raw_read_2.fq\n");
     fprintf(stderr, "\n");
@@ -127,9 +144,19 @@ int fsort_usage()
     fprintf(stderr, " -@       [INT]      Threads to compress file.\n");
     fprintf(stderr, " -o       [fq.gz]    bgzipped output fastq file.\n");
     fprintf(stderr, " -m       [mem]      Memory per thread. [1G]\n");
+    fprintf(stderr, " -mem     [mem]      Memory budget of all threads, sizes in-memory runs and merge width. Override -m.\n");
     fprintf(stderr, " -p                  Input fastq is smart pairing.\n");
     fprintf(stderr, " -T       [prefix]   Write temporary files to PREFIX.nnnn.tmp\n");
+    fprintf(stderr, " -tmp-fmt [STR]      Temporary file format, raw, fast (BGZF level 1) or bgzf. [fast]\n");
+    fprintf(stderr, " -bucket  [INT]      Group records into INT hash buckets of the first tag instead of a global sort.\n");
 //     fprintf(stderr, " -report  [csv]      Summapry report.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "\x1b[31m\x1b[1mNotice\x1b[0m :\n");
+    fprintf(stderr, " * If there are more sorted runs than open file limit (ulimit -n) or -mem allows, runs are merged in\n");
+    fprintf(stderr, "   several passes. Temp disk usage and peak RSS of each pass are logged.\n");
+    fprintf(stderr, " * Index of blocks is written to OUTPUT.fbi, which is used by stream -list to read selected barcodes.\n");
+    fprintf(stderr, " * With -bucket, records of a barcode are contiguous and sorted by tags, but barcodes are not in\n");
+    fprintf(stderr, "   global order. Buckets are sorted in memory in parallel, so each bucket should fit in memory.\n");
     fprintf(stderr, "\n");
     return 1;
 }
@@ -141,7 +168,12 @@ int fastq_stream_usage()
     fprintf(stderr, "\nOptions :\n");
     fprintf(stderr, " -tags    [TAGs]     Tags to define read blocks.\n");
     fprintf(stderr, " -script  [FILE]     User defined bash script, process $FQ and generate results to stdout.\n");
+    fprintf(stderr, " -worker  [FILE]     Start -t long-lived workers running this command, blocks are piped to them.\n");
+    fprintf(stderr, " -memfd              Pass blocks to -script by in-memory files instead of files under -tmpdir.\n");
+    fprintf(stderr, " -plugin  [FILE.so]  Process blocks by a shared object in memory, see src/stream_plugin.h.\n");
+    fprintf(stderr, " -plugin-arg [STR]   Argument passed to init() of plugin.\n");
     fprintf(stderr, " -min     [INT]      Mininal reads per block to process.  [2]\n");
+    fprintf(stderr, " -list    [FILE]     Only process blocks of barcodes in this list, seek by index of fsort.\n");
     fprintf(stderr, " -keep               Output unprocessed FASTQ+ records.\n");
     //fprintf(stderr, " -max     [INT]      Maximal reads per block, if more reads, will downsampling. [8000]\n");
     fprintf(stderr, " -fa                 Stream FASTQ output instead of FASTQ.\n");
@@ -151,6 +183,15 @@ int fastq_stream_usage()
     fprintf(stderr, " -o       [FILE]     Path to output file.\n");
     fprintf(stderr, " -nw                 Disable warning messages.\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "\x1b[31m\x1b[1mNotice\x1b[0m :\n");
+    fprintf(stderr, " * With -worker, no temp directory is created. Each block is written to stdin of an idle worker as\n");
+    fprintf(stderr, "   \"#BLOCK UBI\" line, FASTQ records and \"#END UBI\" line. The worker should write output records of\n");
+    fprintf(stderr, "   this block to stdout, then the same \"#END UBI\" line, and flush before reading next block. Tools\n");
+    fprintf(stderr, "   buffering their input should be run line buffered, such as mawk -W interactive.\n");
+    fprintf(stderr, " * With -memfd, $FQ is a /proc path of an in-memory file. Each script runs in a private directory\n");
+    fprintf(stderr, "   under /dev/shm ($TMPDIR or /tmp if not writable), removed after the block unless -keep-tmp.\n");
+    fprintf(stderr, " * -plugin without a slash in the name is loaded from current directory, not from library paths.\n");
+    fprintf(stderr, "\n");
     return 1;
 }
 
@@ -189,7 +230,7 @@ int segment_usage()
 */
 int sam2bam_usage()
 {
-    fprintf(stderr, "# Parse FASTQ+ read name and convert SAM to BAM.\n");
+    fprintf(stderr, "# Parse FASTQ+ read name and convert SAM/BAM/CRAM to BAM.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "\x1b[36m\x1b[1m$\x1b[0m \x1b[1mPISA\x1b[0m sam2bam -report alignment.csv -@ 5 -adjust-mapq -gtf genes.gtf -o aln.bam in.sam[.gz]\n");
     fprintf(stderr, "\nOptions :\n");
@@ -197,10 +238,12 @@ int sam2bam_usage()
     fprintf(stderr, " -t       [INT]       Work threads.\n");
     fprintf(stderr, " -mito    [string]    Mitochondria name. Used to stat ratio of mitochondria reads.\n");
     fprintf(stderr, " -maln    [BAM]       Export mitochondria reads into this file instead of standard output file.\n");
-    fprintf(stderr, " -@       [INT]       Threads to compress bam file.\n");
+    fprintf(stderr, " -@       [INT]       Threads to compress bam file, also to decode BAM or CRAM input.\n");
     fprintf(stderr, " -report  [csv]       Alignment report.\n");
+    fprintf(stderr, " -T       [fasta]     Reference to decode CRAM input, if reference is not embedded or found by REF_PATH.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Note :\n");
+    fprintf(stderr, "* Input can be SAM, gzipped SAM, BAM or CRAM. FASTQ+ tags in read names are moved to BAM tags.\n");
     fprintf(stderr, "* Reads map to multiple loci usually be marked as low quality and filtered at downstream analysis.\n");
     fprintf(stderr, "  But for RNAseq library, if reads map to an exonic locus but also align to 1 or more non-exonic loci,\n");
     fprintf(stderr, "  the exonic locus can be prioritized as primary alignments, and mapping quality adjusts to 255. Tag\n");
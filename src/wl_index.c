@@ -0,0 +1,76 @@
+#include "utils.h"
+#include "bc_hash.h"
+
+int wl_index_usage()
+{
+    fprintf(stderr, "# Compile barcode white list into a binary index for parse.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "\x1b[36m\x1b[1m$\x1b[0m \x1b[1mPISA\x1b[0m wlindex -o barcodes.idx barcodes.txt\n");
+    fprintf(stderr, "\nOptions:\n");
+    fprintf(stderr, " -o       [FILE]     Output index file.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "\x1b[31m\x1b[1mNotice\x1b[0m :\n");
+    fprintf(stderr, " * The index can be used as whitelist in parse -rule directly. It is mapped read-only, so parse\n");
+    fprintf(stderr, "   processes on the same node share one copy in the page cache.\n");
+    fprintf(stderr, " * Barcodes should be ACGT strings of the same length, no longer than %d bp.\n", BC_HASH_MAX_LENGTH);
+    fprintf(stderr, "\n");
+    return 1;
+}
+
+static struct args {
+    const char *input_fname;
+    const char *output_fname;
+} args = {
+    .input_fname = NULL,
+    .output_fname = NULL,
+};
+
+static int parse_args(int argc, char **argv)
+{
+    if (argc == 1) return 1;
+
+    int i;
+    for (i = 1; i < argc;) {
+        const char *a = argv[i++];
+        const char **var = 0;
+
+        if (strcmp(a, "-h") == 0 || strcmp(a, "--help") == 0) return 1;
+        if (strcmp(a, "-o") == 0) var = &args.output_fname;
+
+        if (var != 0) {
+            if (i == argc) error("missing an argument after %s.", a);
+            *var = argv[i++];
+            continue;
+        }
+        if (a[0] == '-' && a[1] != '\0') error("unknown argument, %s", a);
+
+        if (args.input_fname == NULL) {
+            args.input_fname = a;
+            continue;
+        }
+        error("unknown argument, %s", a);
+    }
+
+    if (args.input_fname == NULL) error("No input specfied.");
+    if (args.output_fname == NULL) error("-o is required.");
+    return 0;
+}
+
+int wl_index_main(int argc, char **argv)
+{
+    double t_real;
+    t_real = realtime();
+
+    if (parse_args(argc, argv)) return wl_index_usage();
+
+    struct bc_hash *H = bc_hash_init();
+    if (bc_hash_read(H, args.input_fname))
+        error("Failed to index %s. Barcodes should be ACGT strings of the same length, no longer than %d bp.", args.input_fname, BC_HASH_MAX_LENGTH);
+
+    if (bc_hash_dump(H, args.output_fname)) error("Failed to write index.");
+    LOG_print("Indexed %u barcodes of %d bp.", H->n, H->len);
+    bc_hash_destroy(H);
+
+    LOG_print("Real time: %.3f sec; CPU: %.3f sec.", realtime() - t_real, cputime());
+    return 0;
+}
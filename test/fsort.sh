@@ -0,0 +1,42 @@
+#!/bin/sh
+# Test PISA fsort with demo data, run by `make test` in the top directory.
+set -e
+
+PISA=${PISA:-./PISA}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+# print CB of each record, in order
+cb_list()
+{
+    gzip -dc "$1" | awk 'NR%4==1' | sed 's/.*|||CB:Z:\([^|]*\).*/\1/'
+}
+
+# same FASTQ+ as plain text, plain gzip and BGZF
+$PISA parse -rule 'CB,R1:1-16;UR,R1:17-28;R1,R2:1-91' -1 $tmp/reads.fq demo/demo_1.fq.gz demo/demo_2.fq.gz 2>/dev/null
+$PISA parse -rule 'CB,R1:1-16;UR,R1:17-28;R1,R2:1-91' -1 $tmp/reads.bgzf.fq.gz demo/demo_1.fq.gz demo/demo_2.fq.gz 2>/dev/null
+gzip -c $tmp/reads.fq > $tmp/reads.fq.gz
+
+$PISA fsort -tags CB -o $tmp/sorted.fq.gz $tmp/reads.fq 2>/dev/null
+gzip -dc $tmp/sorted.fq.gz > $tmp/sorted.fq
+for f in reads.fq.gz reads.bgzf.fq.gz; do
+    $PISA fsort -tags CB -o $tmp/out.fq.gz $tmp/$f 2>/dev/null
+    gzip -dc $tmp/out.fq.gz | cmp -s $tmp/sorted.fq - || fail "fsort, output of $f differs from plain input"
+done
+n=$(cb_list $tmp/sorted.fq.gz | uniq | wc -l)
+[ "$n" -gt 0 ] && [ "$n" -eq "$(cb_list $tmp/sorted.fq.gz | sort -u | wc -l)" ] || fail "fsort, barcodes are not grouped"
+echo "fsort ok, $n barcodes"
+
+# -bucket groups the same records, barcodes are contiguous
+paste - - - - < $tmp/sorted.fq | sort > $tmp/sorted.txt
+for opt in "-bucket 4" "-bucket 16 -t 2"; do
+    $PISA fsort -tags CB $opt -o $tmp/bucket.fq.gz $tmp/reads.fq.gz 2>/dev/null
+    gzip -dc $tmp/bucket.fq.gz | paste - - - - | sort | cmp -s $tmp/sorted.txt - || fail "fsort $opt, records differ"
+    [ "$(cb_list $tmp/bucket.fq.gz | uniq | wc -l)" -eq "$n" ] || fail "fsort $opt, barcodes are not grouped"
+done
+echo "fsort -bucket ok"
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Test plugins of PISA stream with demo data, run by `make test` in the top directory.
+set -e
+
+PISA=${PISA:-./PISA}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+records()
+{
+    awk 'NR%4==1' "$1" | wc -l
+}
+
+# FASTQ+ of demo, every read is doubled in the second input
+$PISA parse -rule 'CB,R1:1-16;UR,R1:17-28;R1,R2:1-91' -1 $tmp/reads.fq demo/demo_1.fq.gz demo/demo_2.fq.gz 2>/dev/null
+cat $tmp/reads.fq $tmp/reads.fq > $tmp/double.fq
+$PISA fsort -tags CB -o $tmp/single.fq.gz $tmp/reads.fq 2>/dev/null
+$PISA fsort -tags CB -o $tmp/double.fq.gz $tmp/double.fq 2>/dev/null
+
+# dedup.so removes the doubled reads
+$PISA stream -tags CB -keep -plugin plugins/dedup.so -o $tmp/dedup1.fq $tmp/single.fq.gz 2>/dev/null
+$PISA stream -tags CB -keep -plugin plugins/dedup.so -o $tmp/dedup2.fq $tmp/double.fq.gz 2>/dev/null
+n0=$(records $tmp/reads.fq)
+n1=$(records $tmp/dedup1.fq)
+n2=$(records $tmp/dedup2.fq)
+[ "$n1" -gt 0 ] && [ "$n1" -le "$n0" ] || fail "dedup.so, $n1 reads from $n0 reads"
+[ "$n1" -eq "$n2" ] || fail "dedup.so, $n2 reads from doubled input, expect $n1"
+echo "dedup.so ok, $n0 reads, $n1 reads after dedup"
+
+# kmer_count.so on a fixed block
+cat > $tmp/kmer.fq <<EOT
+@r1|||CB:Z:AAAA
+ACGTACGTAC
++
+IIIIIIIIII
+@r2|||CB:Z:AAAA
+ACGTAC
++
+IIIIII
+EOT
+# 4-mers ACGT, CGTA and GTAC are seen 3 times, TACG is seen once and not written
+cat > $tmp/kmer.exp <<EOT
+>kmer1|||KC:i:3|||CB:Z:AAAA
+ACGT
+>kmer2|||KC:i:3|||CB:Z:AAAA
+CGTA
+>kmer3|||KC:i:3|||CB:Z:AAAA
+GTAC
+EOT
+$PISA stream -tags CB -plugin plugins/kmer_count.so -plugin-arg 4 -o $tmp/kmer.out $tmp/kmer.fq 2>/dev/null
+cmp -s $tmp/kmer.exp $tmp/kmer.out || fail "kmer_count.so, unexpected output"
+echo "kmer_count.so ok"